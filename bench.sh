@@ -0,0 +1,291 @@
+#!/bin/bash
+
+# Benchmark dcat against cat on synthetic corpora and write the results
+# as JSON.  dcat's output is checked against cat's before each option set
+# is timed; a wrong output or a failed run is recorded and makes the exit
+# status nonzero.
+
+# Usage: ./bench.sh [--dcat PATH] [--cat PATH] [--size MB] [--repeats N]
+#                   [--warmup N] [--dir DIR] [--out FILE] [--sink pipe|null]
+#                   [--cold]
+
+set -u
+
+DCAT=./src/dcat
+CAT=cat
+SIZE_MB=256
+REPEATS=10
+WARMUP=2
+DIR=${TMPDIR:-/tmp}/dcat-bench
+OUT=bench.json
+SINK=pipe
+COLD=0
+
+usage() {
+    sed -n '8,10s/^# \{0,1\}//p' "$0"
+    exit "$1"
+}
+
+while [ "$#" -gt 0 ]; do
+    case "$1" in
+    --dcat) DCAT=$2; shift ;;
+    --cat) CAT=$2; shift ;;
+    --size) SIZE_MB=$2; shift ;;
+    --repeats) REPEATS=$2; shift ;;
+    --warmup) WARMUP=$2; shift ;;
+    --dir) DIR=$2; shift ;;
+    --out) OUT=$2; shift ;;
+    --sink) SINK=$2; shift ;;
+    --cold) COLD=1 ;;
+    -h | --help) usage 0 ;;
+    *) usage 1 ;;
+    esac
+    shift
+done
+
+if [ ! -x "$DCAT" ]; then
+    echo "bench.sh: $DCAT: not an executable; build dcat first" >&2
+    exit 1
+fi
+case "$SINK" in
+pipe | null) ;;
+*) echo "bench.sh: --sink must be pipe or null" >&2; exit 1 ;;
+esac
+
+# Cold-cache runs need to drop the page cache, which only root can do
+if [ "$COLD" = 1 ] && ! [ -w /proc/sys/vm/drop_caches ]; then
+    echo "bench.sh: cannot drop the page cache; skipping cold runs" >&2
+    COLD=0
+fi
+
+# Option sets both tools have, then ones only dcat has
+OPTIONS=("" "-n" "-b" "-s" "-A")
+DCAT_ONLY=("--hex-dump")
+
+BYTES=$((SIZE_MB * 1024 * 1024))
+TINY_FILES=10000
+# Files per run of a tool.  Left to xargs, where the command line is cut
+# depends on the length of the tool's path, and so would where -n starts
+# counting again.
+ARGS_PER_RUN=2000
+mkdir -p "$DIR"
+
+# Generate each corpus once; later runs reuse them while the size matches
+make_corpus() {
+    local name=$1 path=$DIR/$1
+    if [ "$name" = tiny ]; then
+        [ -f "$path/$((TINY_FILES - 1))" ] && return
+        rm -rf "$path"; mkdir -p "$path"
+        awk -v n=$TINY_FILES -v dir="$path" 'BEGIN {
+            srand(1)
+            for (i = 0; i < n; i++) {
+                f = dir "/" i
+                for (j = int(rand() * 40) + 1; j > 0; j--)
+                    printf "record %d.%d value=%d\n", i, j, rand() * 1e6 > f
+                close(f)
+            }
+        }'
+        return
+    fi
+    [ -f "$path" ] && [ "$(wc -c < "$path")" -ge "$BYTES" ] && return
+    case "$name" in
+    ascii)
+        awk -v bytes=$BYTES 'BEGIN {
+            srand(1)
+            split("GET POST PUT DELETE", verb, " ")
+            for (n = 0; n < bytes; n += length(line) + 1) {
+                line = sprintf("2025-01-%02d 12:%02d:%02d host%d %s /api/v1/item/%d %d\t%dms",
+                    n % 28 + 1, n % 60, (n / 7) % 60, rand() * 100,
+                    verb[int(rand() * 4) + 1], rand() * 1e6, 200 + int(rand() * 4) * 100,
+                    rand() * 1000)
+                print line
+                if (rand() < 0.05) print ""
+            }
+        }' > "$path" ;;
+    long)
+        awk -v bytes=$BYTES 'BEGIN {
+            srand(1)
+            chunk = ""
+            for (i = 0; i < 1024; i++) chunk = chunk sprintf("%c", 33 + int(rand() * 94))
+            for (n = 0; n < bytes; n += 65537) {
+                line = ""
+                for (i = 0; i < 64; i++) line = line chunk
+                print line
+            }
+        }' > "$path" ;;
+    blank)
+        head -c "$BYTES" /dev/zero | tr '\0' '\n' > "$path" ;;
+    binary)
+        head -c "$BYTES" /dev/urandom > "$path" ;;
+    esac
+}
+
+CORPORA=(ascii long blank binary tiny)
+for c in "${CORPORA[@]}"; do
+    echo "bench.sh: preparing $c corpus in $DIR" >&2
+    make_corpus "$c"
+done
+
+corpus_args() {
+    if [ "$1" = tiny ]; then
+        # Numeric order, as a shell glob would not give it
+        seq -f "$DIR/tiny/%.0f" 0 $((TINY_FILES - 1))
+    else
+        echo "$DIR/$1"
+    fi
+}
+
+corpus_bytes() {
+    if [ "$1" = tiny ]; then
+        cat "$DIR"/tiny/* | wc -c
+    else
+        wc -c < "$DIR/$1"
+    fi
+}
+
+drop_caches() {
+    sync
+    echo 3 > /proc/sys/vm/drop_caches
+}
+
+# Run TOOL with OPTS over a corpus once and print the wall time in
+# seconds.  Runs that fail are counted in FAILED_RUNS.
+run_once() {
+    local tool=$1 opts=$2 start end status
+    start=$(date +%s%N)
+    if [ "$SINK" = pipe ]; then
+        # shellcheck disable=SC2086
+        xargs -0 -n $ARGS_PER_RUN "$tool" $opts < "$ARGS" | cat > /dev/null
+        status=${PIPESTATUS[0]}
+    else
+        # shellcheck disable=SC2086
+        xargs -0 -n $ARGS_PER_RUN "$tool" $opts < "$ARGS" > /dev/null
+        status=$?
+    fi
+    end=$(date +%s%N)
+    [ "$status" = 0 ] || FAILED_RUNS=$((FAILED_RUNS + 1))
+    awk -v ns=$((end - start)) 'BEGIN { printf "%.6f\n", ns / 1e9 }'
+}
+
+# Print the checksum of TOOL's output with OPTS over a corpus; fails if
+# TOOL does
+output_sum() {
+    # shellcheck disable=SC2086
+    xargs -0 -n $ARGS_PER_RUN "$1" $2 < "$ARGS" | cksum
+    return "${PIPESTATUS[0]}"
+}
+
+# Before timing anything, check that dcat writes what cat does with OPTS
+# over CORPUS, or with COMPARE=no that it just succeeds.  Sets OUTPUT to
+# "same", "differs", "failed" or "unchecked".
+check_output() {
+    local corpus=$1 opts=$2 compare=$3 want got
+    if ! got=$(output_sum "$DCAT" "$opts"); then
+        OUTPUT=failed
+    elif [ "$compare" = no ]; then
+        OUTPUT=unchecked
+    elif ! want=$(output_sum "$CAT" "$opts"); then
+        OUTPUT=failed
+    elif [ "$want" != "$got" ]; then
+        OUTPUT=differs
+    else
+        OUTPUT=same
+    fi
+    case "$OUTPUT" in
+    failed | differs)
+        echo "bench.sh: $corpus ${opts:-(none)}: output check $OUTPUT" >&2
+        STATUS=1 ;;
+    esac
+}
+
+# Print "median p95" of the times on stdin
+summarize() {
+    sort -n | awk '{ t[NR] = $1 }
+        END {
+            p = int(NR * 0.95 + 0.999999)
+            if (NR % 2) m = t[(NR + 1) / 2]
+            else m = (t[NR / 2] + t[NR / 2 + 1]) / 2
+            printf "%.6f %.6f\n", m, t[p]
+        }'
+}
+
+ARGS=$(mktemp)
+TIMES=$(mktemp)
+RESULTS=$(mktemp)
+trap 'rm -f "$ARGS" "$TIMES" "$RESULTS"' EXIT
+
+# One benchmark: print a table row and append a JSON record
+bench() {
+    local corpus=$1 bytes=$2 tool_name=$3 tool=$4 opts=$5 cache=$6
+    local i median p95 gbps
+
+    FAILED_RUNS=0
+    if [ "$cache" = warm ]; then
+        for ((i = 0; i < WARMUP; i++)); do
+            run_once "$tool" "$opts" > /dev/null
+        done
+    fi
+    : > "$TIMES"
+    for ((i = 0; i < REPEATS; i++)); do
+        [ "$cache" = cold ] && drop_caches
+        run_once "$tool" "$opts" >> "$TIMES"
+    done
+    if [ "$FAILED_RUNS" -gt 0 ]; then
+        echo "bench.sh: $corpus ${opts:-(none)}: $FAILED_RUNS $tool_name" \
+            "runs failed" >&2
+        STATUS=1
+    fi
+    read -r median p95 < <(summarize < "$TIMES")
+    gbps=$(awk -v b="$bytes" -v t="$median" 'BEGIN { printf "%.3f", (t > 0 ? b / t / 1e9 : 0) }')
+
+    printf "%-7s %-11s %-5s %-5s %10s %10s %8s\n" "$corpus" "${opts:-(none)}" \
+        "$cache" "$tool_name" "$median" "$p95" "$gbps"
+    printf '    {"corpus": "%s", "bytes": %s, "options": "%s", "cache": "%s", "tool": "%s", "runs": %s, "median_s": %s, "p95_s": %s, "gb_per_s": %s, "times_s": [%s], "output": "%s", "failed_runs": %s}' \
+        "$corpus" "$bytes" "$opts" "$cache" "$tool_name" "$REPEATS" \
+        "$median" "$p95" "$gbps" "$(paste -sd, "$TIMES")" "$OUTPUT" \
+        "$FAILED_RUNS" >> "$RESULTS"
+    printf ',\n' >> "$RESULTS"
+}
+
+printf "%-7s %-11s %-5s %-5s %10s %10s %8s\n" corpus options cache tool \
+    median_s p95_s GB/s
+CACHES=(warm)
+[ "$COLD" = 1 ] && CACHES+=(cold)
+STATUS=0
+for c in "${CORPORA[@]}"; do
+    corpus_args "$c" | tr '\n' '\0' > "$ARGS"
+    bytes=$(corpus_bytes "$c")
+    for opts in "${OPTIONS[@]}"; do
+        check_output "$c" "$opts" yes
+        for cache in "${CACHES[@]}"; do
+            bench "$c" "$bytes" dcat "$DCAT" "$opts" "$cache"
+            bench "$c" "$bytes" cat "$CAT" "$opts" "$cache"
+        done
+    done
+    for opts in "${DCAT_ONLY[@]}"; do
+        check_output "$c" "$opts" no
+        for cache in "${CACHES[@]}"; do
+            bench "$c" "$bytes" dcat "$DCAT" "$opts" "$cache"
+        done
+    done
+done
+
+{
+    printf '{\n'
+    printf '  "date": "%s",\n' "$(date -u +%Y-%m-%dT%H:%M:%SZ)"
+    printf '  "host": "%s",\n' "$(uname -srm)"
+    printf '  "cpus": %s,\n' "$(getconf _NPROCESSORS_ONLN)"
+    printf '  "dcat": "%s",\n' "$("$DCAT" --version | head -n 1)"
+    printf '  "cat": "%s",\n' "$("$CAT" --version 2>/dev/null | head -n 1)"
+    printf '  "sink": "%s",\n' "$SINK"
+    printf '  "warmup": %s,\n' "$WARMUP"
+    printf '  "results": [\n'
+    sed '$ s/,$//' "$RESULTS"
+    printf '  ]\n'
+    printf '}\n'
+} > "$OUT"
+echo "bench.sh: results written to $OUT" >&2
+if [ "$STATUS" != 0 ]; then
+    echo "bench.sh: some runs failed or gave the wrong output; see above" >&2
+fi
+exit "$STATUS"
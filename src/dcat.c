@@ -21,11 +21,51 @@
 #include <config.h>
 #include <ctype.h>
 #include <errno.h>
+#include <fcntl.h>
 #include <getopt.h>
+#include <limits.h>
+#include <poll.h>
+#include <setjmp.h>
+#include <signal.h>
+#ifdef HAVE_PTHREAD
+#include <pthread.h>
+#endif
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#ifdef HAVE_SYS_MMAN_H
+#include <sys/mman.h>
+#endif
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <time.h>
 #include <unistd.h>
+#include "libdcat.h"
+#ifdef HAVE_SYS_SENDFILE_H
+#include <sys/sendfile.h>
+#endif
+#if defined(HAVE_SYS_INOTIFY_H) && defined(HAVE_SYS_EPOLL_H)
+#include <sys/epoll.h>
+#include <sys/inotify.h>
+#endif
+#ifdef HAVE_ZLIB
+#include <zlib.h>
+#endif
+#ifdef HAVE_ZSTD
+#include <zstd.h>
+#endif
+#ifdef HAVE_LINUX_FS_H
+#include <linux/fs.h>
+#include <sys/ioctl.h>
+#endif
+#ifdef HAVE_LINUX_PERF_EVENT_H
+#include <linux/perf_event.h>
+#include <sys/syscall.h>
+#endif
+#if defined(HAVE_IO_URING) && defined(HAVE_MMAP)
+#include <linux/io_uring.h>
+#include <sys/syscall.h>
+#endif
 
 /* Options */
 static struct option const long_options[] = {
@@ -39,6 +79,20 @@ static struct option const long_options[] = {
     {"buffer-size", required_argument, NULL, 256},
     {"progress", no_argument, NULL, 257},
     {"hex-dump", no_argument, NULL, 258},
+    {"threads", required_argument, NULL, 259},
+    {"pipeline", optional_argument, NULL, 260},
+    {"io", required_argument, NULL, 261},
+    {"prefetch", required_argument, NULL, 262},
+    {"stats", optional_argument, NULL, 263},
+    {"follow", no_argument, NULL, 264},
+    {"decompress", no_argument, NULL, 265},
+    {"offset", required_argument, NULL, 266},
+    {"length", required_argument, NULL, 267},
+    {"no-cache", no_argument, NULL, 268},
+    {"jobs", required_argument, NULL, 269},
+    {"build-index", optional_argument, NULL, 270},
+    {"lines", required_argument, NULL, 271},
+    {"flush", required_argument, NULL, 272},
     {"help", no_argument, NULL, 'h'},
     {"version", no_argument, NULL, 'V'},
     {NULL, 0, NULL, 0}};
@@ -54,278 +108,3915 @@ static int show_nonprinting = 0;
 static size_t custom_buffer_size = 0; /* 0 means use default */
 static int show_progress = 0;
 static int hex_dump_mode = 0;
+static int thread_count = 1;
+static int pipeline_depth = 0; /* buffers per --pipeline ring, 0 if off */
+static int io_backend = 0;     /* IO_SYNC or IO_URING */
+static int prefetch_count = 0; /* files --prefetch opens ahead */
+static int stats_mode = 0;     /* STATS_OFF, STATS_TEXT or STATS_JSON */
+static int follow_mode = 0;    /* keep reading the last file as it grows */
+static int decompress_mode = 0; /* decode gzip and zstd input */
+static unsigned long long range_offset = 0; /* --offset into each file */
+static unsigned long long range_length = ULLONG_MAX; /* --length, if any */
+static int no_cache = 0; /* keep input and output out of the page cache */
+static int job_count = 0; /* threads --jobs opens and reads files with */
+static long index_interval = 0; /* --build-index lines per entry, if on */
+static unsigned long long lines_first = 0; /* --lines=A-B, if given */
+static unsigned long long lines_last = ULLONG_MAX;
+
+/* --flush state */
+static struct {
+  int policy;                  /* FLUSH_EACH, FLUSH_LINE, ... */
+  unsigned long long interval; /* for FLUSH_INTERVAL, in ns */
+  unsigned long long since; /* when output began waiting in ctx, 0 if not */
+  struct dcat_ctx *ctx;     /* the context it waits in */
+} flush;
+
+/* Largest buffer picked without --buffer-size, and the size used when
+   nothing is known about the input */
+#define DEFAULT_BUFFER_SIZE 4194304 /* 4MB buffer */
+
+/* Bounds for formatting blocks sized to the cache, and the size used when
+   the cache size is unknown */
+#define MIN_FORMAT_SIZE 65536
+#define DEFAULT_FORMAT_SIZE 262144
+
+/* Capacity to grow a pipe on stdout to: the default /proc/sys/fs/pipe-max-size
+   that unprivileged processes may ask for */
+#define PIPE_OUTPUT_SIZE 1048576
+
+/* Most threads --threads accepts */
+#define MAX_THREADS 256
+
+/* Ring sizes --pipeline accepts, and the default */
+#define MAX_PIPELINE 64
+#define DEFAULT_PIPELINE 4
+
+/* Smallest block worth splitting across threads */
+#define MIN_PARALLEL_SIZE 65536
+
+/* Address space mapped at once when reading regular files with mmap */
+#define MMAP_WINDOW_SIZE 67108864 /* 64MB window */
+
+/* In-kernel copy methods for the no-options path, in order of preference */
+enum { ZC_COPY_FILE_RANGE, ZC_SENDFILE, ZC_SPLICE, ZC_NONE };
+
+/* Ways --io can read the files named on the command line */
+enum { IO_SYNC, IO_URING };
+
+/* Files --io=uring keeps in flight, and the block read from each at once */
+#define URING_FILES 32
+#define URING_BLOCK_SIZE 131072
+
+/* When output is written: after every block of input without --flush, or
+   as --flush=line, =block or =interval=MS says */
+enum { FLUSH_EACH, FLUSH_LINE, FLUSH_BLOCK, FLUSH_INTERVAL };
+
+/* What --stats prints */
+enum { STATS_OFF, STATS_TEXT, STATS_JSON };
+
+/* Shortest time between two redraws of the --progress line */
+#define PROGRESS_INTERVAL 250000000ULL /* 250ms */
+
+/* Most files --prefetch opens ahead */
+#define MAX_PREFETCH 64
+
+/* Most threads --jobs starts, which is also how far ahead they read */
+#define MAX_JOBS MAX_PREFETCH
+
+/* How often --follow looks for a file again without inotify */
+#define FOLLOW_INTERVAL 1 /* seconds */
+
+/* Largest zstd frame --decompress decodes whole, on its own thread */
+#define MAX_FRAME_SIZE 67108864 /* 64MB */
+
+/* Written output --no-cache leaves in the page cache while it is written
+   back, and the input or output dropped from it at once */
+#define NO_CACHE_WINDOW 8388608 /* 8MB */
+
+/* Sidecar file --build-index writes next to each FILE, and the lines
+   between its entries by default */
+#define INDEX_SUFFIX ".dcatidx"
+#define DEFAULT_INDEX_INTERVAL 16384
+
+/* The index is a header -- the magic, then the interval, the file's size
+   and modification time in ns, its newline and empty line counts, and the
+   entry count -- and an entry for every interval lines: the offset the
+   next line starts at, and the empty lines before it.  Numbers are 64-bit
+   little-endian.  */
+#define INDEX_MAGIC "DCATIDX1"
+#define INDEX_HEADER_SIZE 56
+#define INDEX_ENTRY_SIZE 16
+
+/* Reads when counting lines, and the stretch of a file each thread
+   counts at a time while looking for a line */
+#define SCAN_BLOCK_SIZE 1048576
+#define SCAN_CHUNK_SIZE 16777216 /* 16MB */
+
+/* Most buffers the buffer pool tracks, and the huge page size big buffers
+   are rounded to */
+#define MAX_BUFFERS 256
+#define HUGE_PAGE_SIZE 2097152
+
+static void usage(int status) {
+  if (status != 0) {
+    fprintf(stderr, "Try '%s --help' for more information.\n", PACKAGE_NAME);
+  } else {
+    printf("Usage: %s [OPTION]... [FILE]...\n", PACKAGE_NAME);
+    printf("Concatenate FILE(s) to standard output.\n\n");
+    printf("With no FILE, or when FILE is -, read standard input.\n\n");
+    printf("  -A, --show-all           equivalent to -vET\n");
+    printf("  -b, --number-nonblank    number nonempty output lines, overrides "
+           "-n\n");
+    printf("  -e                       equivalent to -vE\n");
+    printf("  -E, --show-ends          display $ at end of each line\n");
+    printf("  -n, --number             number all output lines\n");
+    printf("  -s, --squeeze-blank      suppress repeated empty output lines\n");
+    printf("  -t                       equivalent to -vT\n");
+    printf("  -T, --show-tabs          display TAB characters as ^I\n");
+    printf("  -v, --show-nonprinting   use ^ and M- notation, except for LFD "
+           "and TAB\n");
+    printf("      --buffer-size=SIZE   use SIZE-byte buffers (default: sized "
+           "to the input)\n");
+    printf("      --progress           show progress, rate and time left on "
+           "standard error\n");
+    printf("      --hex-dump           show hex dump of binary data\n");
+    printf("      --threads=N          use N threads for --hex-dump and "
+           "formatting\n");
+    printf("      --pipeline[=N]       read, format and write in separate "
+           "threads,\n"
+           "                             with N buffers in flight (default "
+           "%d)\n",
+           DEFAULT_PIPELINE);
+    printf("      --io=METHOD          read files with METHOD: sync (default) "
+           "or uring\n");
+    printf("      --prefetch=N         open the next N files early and start "
+           "reading them\n");
+    printf("      --stats[=json]       print I/O and timing figures on "
+           "standard error\n");
+    printf("      --follow             output data appended to the last FILE "
+           "as it grows\n");
+    printf("      --decompress         decompress gzip and zstd input, "
+           "pass other input through\n");
+    printf("      --offset=N           start each FILE at byte N\n");
+    printf("      --length=N           output at most N bytes of each FILE"
+           "\n");
+    printf("      --no-cache           read with O_DIRECT and keep input and "
+           "output\n"
+           "                             out of the page cache\n");
+    printf("      --jobs=N             open and read the next N files in N "
+           "threads\n");
+    printf("      --build-index[=K]    write where every Kth line ends "
+           "(default %d) to\n"
+           "                             FILE%s, instead of output\n",
+           DEFAULT_INDEX_INTERVAL, INDEX_SUFFIX);
+    printf("      --lines=A-B          output lines A to B of each FILE, "
+           "using its index\n");
+    printf("      --flush=POLICY       write output at each line end (line), "
+           "only in full\n"
+           "                             buffers (block), or within MS "
+           "milliseconds\n"
+           "                             (interval=MS)\n");
+    printf("      --help               display this help and exit\n");
+    printf(
+        "      --version            output version information and exit\n\n");
+    printf("Examples:\n");
+    printf("  %s f - g  Output f's contents, then standard input, then g's "
+           "contents.\n",
+           PACKAGE_NAME);
+    printf("  %s        Copy standard input to standard output.\n\n",
+           PACKAGE_NAME);
+  }
+  exit(status);
+}
+
+/* Parse a byte count for --offset or --length: digits, optionally
+   followed by K, M, G or T for powers of 1024.  Returns 0 on success.  */
+static int parse_size(const char *text, unsigned long long *size) {
+  static const char units[] = "KMGT";
+  const char *unit;
+  char *end;
+  unsigned long long n;
+
+  if (!isdigit((unsigned char)*text))
+    return -1;
+  errno = 0;
+  n = strtoull(text, &end, 10);
+  if (errno != 0)
+    return -1;
+  if (*end) {
+    if (end[1] || !(unit = strchr(units, toupper((unsigned char)*end))))
+      return -1;
+    for (int i = 0; i <= unit - units; i++) {
+      if (n > ULLONG_MAX / 1024)
+        return -1;
+      n *= 1024;
+    }
+  }
+  *size = n;
+  return 0;
+}
+
+/* Parse --lines: A-B, A- for line A to the end, or just A.  Returns 0 on
+   success.  */
+static int parse_lines(const char *text) {
+  char *end;
+
+  if (!isdigit((unsigned char)*text))
+    return -1;
+  errno = 0;
+  lines_first = strtoull(text, &end, 10);
+  if (errno != 0 || lines_first == 0)
+    return -1;
+  if (*end == '\0') {
+    lines_last = lines_first;
+    return 0;
+  }
+  if (*end != '-')
+    return -1;
+  text = end + 1;
+  if (*text == '\0') {
+    lines_last = ULLONG_MAX;
+    return 0;
+  }
+  if (!isdigit((unsigned char)*text))
+    return -1;
+  lines_last = strtoull(text, &end, 10);
+  if (errno != 0 || *end || lines_last < lines_first)
+    return -1;
+  return 0;
+}
+
+/* Parse --flush into flush.  Returns 0 on success.  */
+static int parse_flush(const char *text) {
+  char *end;
+  long ms;
+
+  if (strcmp(text, "line") == 0) {
+    flush.policy = FLUSH_LINE;
+    return 0;
+  }
+  if (strcmp(text, "block") == 0) {
+    flush.policy = FLUSH_BLOCK;
+    return 0;
+  }
+  if (strncmp(text, "interval=", 9) != 0 || !isdigit((unsigned char)text[9]))
+    return -1;
+  errno = 0;
+  ms = strtol(text + 9, &end, 10);
+  if (errno != 0 || *end || ms < 1 || ms > INT_MAX)
+    return -1;
+  flush.policy = FLUSH_INTERVAL;
+  flush.interval = ms * 1000000ULL;
+  return 0;
+}
+
+/* Print the version and the scan KERNELS in use, then exit */
+static void version(const char *kernels) {
+  printf("%s %s\n", PACKAGE_NAME, VERSION);
+  printf("Copyright (C) 2025 Juan Manuel Rodriguez.\n");
+  printf("License GPLv3+: GNU GPL version 3 or later "
+         "<https://gnu.org/licenses/gpl.html>.\n");
+  printf(
+      "This is free software: you are free to change and redistribute it.\n");
+  printf("There is NO WARRANTY, to the extent permitted by law.\n\n");
+  printf("Written by %s.\n\n", AUTHOR);
+  printf("Scan kernels: %s\n", kernels);
+  exit(0);
+}
+
+#ifdef HAVE_PTHREAD
+#define THREAD_LOCAL __thread
+#else
+#define THREAD_LOCAL
+#endif
+
+/* --stats counters, running totals for the whole run.  Reader and writer
+   threads count too, hence the atomic adds; with --stats off the only
+   cost is testing stats_mode.  */
+enum {
+  ST_BYTES_IN,
+  ST_BYTES_OUT,
+  ST_READS,  /* read calls, mmap windows and io_uring reads */
+  ST_WRITES, /* write calls and in-kernel copies */
+  ST_SHORT_WRITES,
+  ST_READ_NS,
+  ST_FORMAT_NS,
+  ST_WRITE_NS,
+  ST_WALL_NS,
+  ST_CYCLES,
+  ST_INSTRUCTIONS,
+  ST_COUNT
+};
+static unsigned long long stats[ST_COUNT];
+
+/* Time this thread spent writing, to keep it out of the formatting time
+   when a full output buffer is flushed mid-block */
+static THREAD_LOCAL unsigned long long write_ns_here;
+
+#define stats_add(i, n) __atomic_fetch_add(&stats[i], (n), __ATOMIC_RELAXED)
+
+static unsigned long long stats_clock(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/* Count a write call that moved N of COUNT bytes, started at START */
+static void stats_write(ssize_t n, size_t count, unsigned long long start) {
+  unsigned long long ns = stats_clock() - start;
+
+  stats_add(ST_WRITES, 1);
+  stats_add(ST_WRITE_NS, ns);
+  write_ns_here += ns;
+  if (n > 0) {
+    stats_add(ST_BYTES_OUT, n);
+    if ((size_t)n < count)
+      stats_add(ST_SHORT_WRITES, 1);
+  }
+}
+
+/* Start timing formatting work; pass the result to format_timed() */
+static unsigned long long format_start(void) {
+  return stats_mode ? stats_clock() - write_ns_here : 0;
+}
+
+static void format_timed(unsigned long long start) {
+  if (stats_mode)
+    stats_add(ST_FORMAT_NS, stats_clock() - write_ns_here - start);
+}
+
+/* --no-cache: the part of a file read or written so far, [START, END),
+   and how much of it is still in the page cache, from START.  START is
+   -1 if the file is not one the page cache holds.  */
+struct cache_trail {
+  off_t start;
+  off_t end;
+};
+static struct cache_trail out_trail = {-1, -1};
+
+/* Start a trail on FD from its current offset */
+static void cache_trail_init(struct cache_trail *t, int fd) {
+  struct stat st;
+  int flags = fcntl(fd, F_GETFL);
+
+  t->start = t->end = -1;
+  if (fstat(fd, &st) != 0 || !S_ISREG(st.st_mode))
+    return;
+  t->start = t->end =
+      flags >= 0 && (flags & O_APPEND) ? st.st_size : lseek(fd, 0, SEEK_CUR);
+}
+
+/* Add N bytes to the trail on FD.  Input is dropped from the page cache
+   once read, since dcat has its own copy; output is first written back,
+   which starts at once and is waited for one window later, and dropped
+   after that.  */
+static void cache_trail_add(struct cache_trail *t, int fd, size_t n,
+                            int written) {
+  off_t keep = written ? NO_CACHE_WINDOW : 0;
+
+  off_t stop;
+
+  if (t->start < 0 || n == 0)
+    return;
+  t->end += n;
+#ifdef HAVE_SYNC_FILE_RANGE
+  if (written)
+    sync_file_range(fd, t->end - n, n, SYNC_FILE_RANGE_WRITE);
+#endif
+  if (t->end - t->start < keep + NO_CACHE_WINDOW)
+    return;
+  /* Stop on a huge page boundary: the page cache may hold the file in
+     large folios, and one that straddles the end of the range would be
+     kept by this call and the next alike */
+  stop = (t->end - keep) / HUGE_PAGE_SIZE * HUGE_PAGE_SIZE;
+  if (stop <= t->start)
+    return;
+#ifdef HAVE_SYNC_FILE_RANGE
+  if (written)
+    sync_file_range(fd, t->start, stop - t->start,
+                    SYNC_FILE_RANGE_WAIT_BEFORE | SYNC_FILE_RANGE_WRITE |
+                        SYNC_FILE_RANGE_WAIT_AFTER);
+#endif
+#ifdef HAVE_POSIX_FADVISE
+  posix_fadvise(fd, t->start, stop - t->start, POSIX_FADV_DONTNEED);
+#endif
+  t->start = stop;
+}
+
+/* Drop all of the trail on FD, at the end of the file */
+static void cache_trail_end(struct cache_trail *t, int fd) {
+  if (t->start < 0 || t->end == t->start)
+    return;
+#ifdef HAVE_SYNC_FILE_RANGE
+  sync_file_range(fd, t->start, t->end - t->start,
+                  SYNC_FILE_RANGE_WAIT_BEFORE | SYNC_FILE_RANGE_WRITE |
+                      SYNC_FILE_RANGE_WAIT_AFTER);
+#endif
+#ifdef HAVE_POSIX_FADVISE
+  posix_fadvise(fd, t->start, 0, POSIX_FADV_DONTNEED); /* to the end */
+#endif
+  t->start = t->end;
+}
+
+/* Turn off O_DIRECT on FD after a read it refused, as it does for a
+   buffer, size or offset not aligned to the device's blocks.  Returns 1 if
+   it was on.  */
+static int direct_off(int fd) {
+#ifdef O_DIRECT
+  int flags = fcntl(fd, F_GETFL);
+
+  if (flags >= 0 && (flags & O_DIRECT))
+    return fcntl(fd, F_SETFL, flags & ~O_DIRECT) == 0;
+#else
+  (void)fd;
+#endif
+  return 0;
+}
+
+/* Read up to COUNT bytes, retrying when interrupted by a signal */
+static ssize_t safe_read(int fd, void *buf, size_t count) {
+  unsigned long long start = stats_mode ? stats_clock() : 0;
+
+  for (;;) {
+    ssize_t n = read(fd, buf, count);
+    /* --no-cache: go on through the page cache if O_DIRECT cannot */
+    if (n < 0 && errno == EINVAL && no_cache && direct_off(fd))
+      continue;
+    if (n >= 0 || errno != EINTR) {
+      if (stats_mode) {
+        stats_add(ST_READS, 1);
+        stats_add(ST_READ_NS, stats_clock() - start);
+        if (n > 0)
+          stats_add(ST_BYTES_IN, n);
+      }
+      return n;
+    }
+  }
+}
+
+/* Read until COUNT bytes are in BUF or the input ends.  Returns the number
+   of bytes read, or -1 on error.  */
+static ssize_t full_read(int fd, void *buf, size_t count) {
+  size_t total = 0;
+
+  while (total < count) {
+    ssize_t n = safe_read(fd, (char *)buf + total, count - total);
+    if (n < 0)
+      return -1;
+    if (n == 0)
+      break;
+    total += n;
+  }
+  return total;
+}
+
+/* Write all COUNT bytes of BUF, resuming after short writes and signals.
+   Returns 0 on success, -1 on error.  */
+static int full_write(int fd, const void *buf, size_t count) {
+  const char *ptr = buf;
+
+  while (count > 0) {
+    unsigned long long start = stats_mode ? stats_clock() : 0;
+    ssize_t n = write(fd, ptr, count);
+    if (stats_mode)
+      stats_write(n, count, start);
+    if (n < 0) {
+      if (errno == EINTR)
+        continue;
+      return -1;
+    }
+    if (fd == STDOUT_FILENO)
+      cache_trail_add(&out_trail, fd, n, 1);
+    ptr += n;
+    count -= n;
+  }
+  return 0;
+}
+
+/* Write all of IOV, resuming after short writes and signals.  IOV is
+   updated in place.  Returns 0 on success, -1 on error.  */
+static int full_writev(int fd, struct iovec *iov, int iovcnt) {
+  while (iovcnt > 0) {
+    int count = iovcnt < IOV_MAX ? iovcnt : IOV_MAX;
+    unsigned long long start = stats_mode ? stats_clock() : 0;
+    ssize_t n = writev(fd, iov, count);
+    if (stats_mode) {
+      size_t want = 0;
+      for (int i = 0; i < count; i++)
+        want += iov[i].iov_len;
+      stats_write(n, want, start);
+    }
+    if (n < 0) {
+      if (errno == EINTR)
+        continue;
+      return -1;
+    }
+    if (fd == STDOUT_FILENO)
+      cache_trail_add(&out_trail, fd, n, 1);
+    while (iovcnt > 0 && (size_t)n >= iov->iov_len) {
+      n -= iov->iov_len;
+      iov++;
+      iovcnt--;
+    }
+    if (iovcnt > 0) {
+      iov->iov_base = (char *)iov->iov_base + n;
+      iov->iov_len -= n;
+    }
+  }
+  return 0;
+}
+
+/* I/O buffers come from one pool for the whole run, so a new file reuses
+   the pages an earlier one already faulted in instead of allocating its
+   own.  Buffers are page aligned and a whole number of pages long, as
+   O_DIRECT wants, and ones of a huge page or more are rounded to huge
+   pages and backed by them when the system allows.  Only the main thread
+   takes and returns buffers.  */
+struct pooled_buffer {
+  char *data;
+  size_t size;
+  int used;
+};
+static struct pooled_buffer buffer_pool[MAX_BUFFERS];
+static int buffer_pool_count;
+
+/* Allocate SIZE bytes, a multiple of the page size, straight from the
+   system */
+static char *buffer_alloc(size_t size) {
+#if defined(HAVE_MMAP)
+  void *p = MAP_FAILED;
+
+#ifdef MAP_HUGETLB
+  if (size % HUGE_PAGE_SIZE == 0)
+    p = mmap(NULL, size, PROT_READ | PROT_WRITE,
+             MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+#endif
+  if (p == MAP_FAILED) {
+    p = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS,
+             -1, 0);
+    if (p == MAP_FAILED)
+      return NULL;
+#if defined(HAVE_MADVISE) && defined(MADV_HUGEPAGE)
+    /* No reserved huge pages: ask for transparent ones instead */
+    if (size % HUGE_PAGE_SIZE == 0)
+      madvise(p, size, MADV_HUGEPAGE);
+#endif
+  }
+  return p;
+#else
+  void *p;
+  return posix_memalign(&p, sysconf(_SC_PAGESIZE), size) == 0 ? p : NULL;
+#endif
+}
+
+/* Give DATA from buffer_alloc() back to the system */
+static void buffer_free(char *data, size_t size) {
+#if defined(HAVE_MMAP)
+  munmap(data, size);
+#else
+  (void)size;
+  free(data);
+#endif
+}
+
+static void buffer_release(struct pooled_buffer *b) {
+  buffer_free(b->data, b->size);
+  *b = buffer_pool[--buffer_pool_count];
+}
+
+/* Take a buffer of at least SIZE bytes from the pool, or NULL if out of
+   memory */
+static char *buffer_get(size_t size) {
+  static size_t page;
+  struct pooled_buffer *best = NULL;
+  char *data;
+
+  if (page == 0) {
+    long n = sysconf(_SC_PAGESIZE);
+    page = n > 0 ? (size_t)n : 4096;
+  }
+  size = (size + page - 1) / page * page;
+  if (size >= HUGE_PAGE_SIZE)
+    size = (size + HUGE_PAGE_SIZE - 1) / HUGE_PAGE_SIZE * HUGE_PAGE_SIZE;
+
+  for (int i = 0; i < buffer_pool_count; i++) {
+    struct pooled_buffer *b = &buffer_pool[i];
+    if (!b->used && b->size >= size && (!best || b->size < best->size))
+      best = b;
+  }
+  if (best) {
+    best->used = 1;
+    return best->data;
+  }
+
+  /* Free buffers too small for this are too small to be worth keeping */
+  for (int i = buffer_pool_count - 1; i >= 0; i--) {
+    if (!buffer_pool[i].used)
+      buffer_release(&buffer_pool[i]);
+  }
+  if (buffer_pool_count == MAX_BUFFERS || !(data = buffer_alloc(size)))
+    return NULL;
+  buffer_pool[buffer_pool_count].data = data;
+  buffer_pool[buffer_pool_count].size = size;
+  buffer_pool[buffer_pool_count].used = 1;
+  buffer_pool_count++;
+  return data;
+}
+
+/* Give a buffer from buffer_get() back to the pool; NULL is ignored */
+static void buffer_put(char *data) {
+  for (int i = 0; data && i < buffer_pool_count; i++) {
+    if (buffer_pool[i].data == data) {
+      buffer_pool[i].used = 0;
+      return;
+    }
+  }
+}
+
+#ifdef HAVE_PTHREAD
+/* With --pipeline, filled output buffers are queued for a writer thread
+   and formatting carries on in the next free one */
+static struct {
+  int running;
+  pthread_t thread;
+  pthread_mutex_t lock;
+  pthread_cond_t queued_cond;
+  pthread_cond_t freed_cond;
+  char *bufs[MAX_PIPELINE];
+  size_t lens[MAX_PIPELINE];
+  int count;
+  int head;   /* next buffer to write */
+  int queued; /* buffers handed over and not written yet */
+} writer;
+
+static void *writer_thread(void *arg) {
+  (void)arg;
+  pthread_mutex_lock(&writer.lock);
+  for (;;) {
+    while (writer.queued == 0)
+      pthread_cond_wait(&writer.queued_cond, &writer.lock);
+    int head = writer.head;
+    pthread_mutex_unlock(&writer.lock);
+
+    if (full_write(STDOUT_FILENO, writer.bufs[head], writer.lens[head]) !=
+        0) {
+      fprintf(stderr, "%s: write error\n", PACKAGE_NAME);
+      exit(1);
+    }
+
+    pthread_mutex_lock(&writer.lock);
+    writer.head = (writer.head + 1) % writer.count;
+    writer.queued--;
+    pthread_cond_signal(&writer.freed_cond);
+  }
+  return NULL;
+}
+
+/* Allocate the writer's ring of COUNT buffers and start it.  Returns 0 on
+   success; on failure output stays synchronous.  */
+static int writer_start(int count, size_t size) {
+  for (writer.count = 0; writer.count < count; writer.count++) {
+    writer.bufs[writer.count] = buffer_get(size);
+    if (!writer.bufs[writer.count])
+      break;
+  }
+  pthread_mutex_init(&writer.lock, NULL);
+  pthread_cond_init(&writer.queued_cond, NULL);
+  pthread_cond_init(&writer.freed_cond, NULL);
+  if (writer.count < 2 ||
+      pthread_create(&writer.thread, NULL, writer_thread, NULL) != 0) {
+    while (writer.count > 0)
+      buffer_put(writer.bufs[--writer.count]);
+    return -1;
+  }
+  writer.running = 1;
+  return 0;
+}
+
+/* Queue CTX's output buffer for the writer and switch to the next free
+   buffer */
+static void writer_queue(struct dcat_ctx *ctx) {
+  pthread_mutex_lock(&writer.lock);
+  writer.lens[(writer.head + writer.queued) % writer.count] = ctx->out_len;
+  writer.queued++;
+  pthread_cond_signal(&writer.queued_cond);
+  while (writer.queued == writer.count)
+    pthread_cond_wait(&writer.freed_cond, &writer.lock);
+  ctx->out = writer.bufs[(writer.head + writer.queued) % writer.count];
+  pthread_mutex_unlock(&writer.lock);
+}
+#endif
+
+/* Allocate the output buffer.  Returns 0 on success, -1 on failure.  */
+static int out_init(struct dcat_ctx *ctx, size_t size) {
+  if (ctx->out)
+    return 0;
+#ifdef HAVE_PTHREAD
+  if (pipeline_depth > 1 && writer_start(pipeline_depth, size) == 0) {
+    ctx->out = writer.bufs[0];
+    ctx->out_size = size;
+    return 0;
+  }
+#endif
+  ctx->out = buffer_get(size);
+  if (!ctx->out)
+    return -1;
+  ctx->out_size = size;
+  return 0;
+}
+
+/* Write out everything buffered so far; a failed write is fatal */
+static void out_flush(struct dcat_ctx *ctx) {
+  if (ctx->out_len == 0)
+    return;
+#ifdef HAVE_PTHREAD
+  if (writer.running) {
+    writer_queue(ctx);
+    ctx->out_len = 0;
+    flush.since = 0;
+    return;
+  }
+#endif
+  if (full_write(STDOUT_FILENO, ctx->out, ctx->out_len) != 0) {
+    fprintf(stderr, "%s: write error\n", PACKAGE_NAME);
+    exit(1);
+  }
+  ctx->out_len = 0;
+  flush.since = 0;
+}
+
+/* Wait until everything flushed so far has reached stdout, before writing
+   to it some other way */
+static void out_drain(void) {
+#ifdef HAVE_PTHREAD
+  if (writer.running) {
+    pthread_mutex_lock(&writer.lock);
+    while (writer.queued > 0)
+      pthread_cond_wait(&writer.freed_cond, &writer.lock);
+    pthread_mutex_unlock(&writer.lock);
+  }
+#endif
+}
+
+/* Mapped input that its file is truncated under.  Touching a mapped page
+   past the new end of the file raises SIGBUS, which would kill us where
+   read() would just have come up short.  map_guard() names the mapping in
+   use; a fault in it jumps back to whoever armed map_jump, or, in a pool
+   worker or inside pool_run(), where unwinding would strand the batch,
+   maps zeros over the rest of it so the batch can finish and leaves
+   map_faulted for pool_run() to act on.  */
+static sigjmp_buf *map_jump;
+static volatile sig_atomic_t map_faulted;
+
+#ifdef HAVE_MMAP
+static const char *guard_start;
+static size_t guard_len;
+static long guard_page;
+
+static void map_fault(int sig, siginfo_t *info, void *context) {
+  const char *addr = info->si_addr;
+  char *page;
+
+  (void)context;
+  if (!guard_start || addr < guard_start || addr >= guard_start + guard_len) {
+    /* Not ours: die of it as we would have */
+    signal(sig, SIG_DFL);
+    return;
+  }
+  map_faulted = 1;
+  if (map_jump)
+    siglongjmp(*map_jump, 1);
+  page = (char *)guard_start +
+         (size_t)(addr - guard_start) / guard_page * guard_page;
+  if (mmap(page, guard_start + guard_len - page, PROT_READ,
+           MAP_PRIVATE | MAP_ANONYMOUS | MAP_FIXED, -1, 0) == MAP_FAILED)
+    signal(sig, SIG_DFL);
+}
+
+/* Guard the LEN bytes of mapping at START, or nothing if START is NULL */
+static void map_guard(const void *start, size_t len) {
+  if (start && guard_page == 0) {
+    struct sigaction sa;
+
+    memset(&sa, 0, sizeof sa);
+    sa.sa_sigaction = map_fault;
+    sa.sa_flags = SA_SIGINFO;
+    sigemptyset(&sa.sa_mask);
+    guard_page = sysconf(_SC_PAGESIZE);
+    sigaction(SIGBUS, &sa, NULL);
+  }
+  guard_start = start;
+  guard_len = len;
+}
+#endif
+
+/* Have faults in the guarded mapping jump to JUMP, which the caller has
+   just set with sigsetjmp(), until map_disarm() */
+static void map_arm(sigjmp_buf *jump) {
+  map_faulted = 0;
+  map_jump = jump;
+}
+
+static void map_disarm(void) { map_jump = NULL; }
+
+/* Jump to map_jump if the guarded mapping has faulted */
+static void map_check(void) {
+  if (map_faulted && map_jump)
+    siglongjmp(*map_jump, 1);
+}
+
+/* The output of the context main() formats with goes to stdout: a full
+   buffer is flushed, and runs longer than the buffer are written
+   straight from the input */
+static void out_room(struct dcat_ctx *ctx, size_t n) {
+  (void)n;
+  out_flush(ctx);
+}
+
+static void out_direct(struct dcat_ctx *ctx, const char *data, size_t n) {
+  out_flush(ctx);
+  out_drain();
+  if (full_write(STDOUT_FILENO, data, n) != 0) {
+    /* The kernel does not raise SIGBUS on a page it cannot copy from */
+    if (errno == EFAULT && map_jump) {
+      map_faulted = 1;
+      map_check();
+    }
+    fprintf(stderr, "%s: write error\n", PACKAGE_NAME);
+    exit(1);
+  }
+}
+
+/* --flush=line: write out CTX's buffer up to its last newline, keeping
+   the partial line after it for later */
+static void out_flush_lines(struct dcat_ctx *ctx) {
+  size_t n = ctx->out_len;
+  size_t tail;
+
+  while (n > 0 && ctx->out[n - 1] != '\n')
+    n--;
+  if (n == 0 || n == ctx->out_len) {
+    if (n > 0)
+      out_flush(ctx);
+    return;
+  }
+  tail = ctx->out_len - n;
+#ifdef HAVE_PTHREAD
+  if (writer.running) {
+    /* The writer only reads the buffer, and only up to N */
+    char *full = ctx->out;
+
+    ctx->out_len = n;
+    writer_queue(ctx);
+    memcpy(ctx->out, full + n, tail);
+    ctx->out_len = tail;
+    return;
+  }
+#endif
+  if (full_write(STDOUT_FILENO, ctx->out, n) != 0) {
+    fprintf(stderr, "%s: write error\n", PACKAGE_NAME);
+    exit(1);
+  }
+  memmove(ctx->out, ctx->out + n, tail);
+  ctx->out_len = tail;
+}
+
+/* CTX's buffer holds the output of another block of input: write out as
+   much as the --flush policy says.  Without --flush that is all of it, so
+   each read is passed on as soon as it is formatted; with =block,
+   out_room() writes the buffer once it is full and nothing else does.  */
+static void out_block(struct dcat_ctx *ctx) {
+  unsigned long long now;
+
+  switch (flush.policy) {
+  case FLUSH_EACH:
+    out_flush(ctx);
+    break;
+  case FLUSH_LINE:
+    out_flush_lines(ctx);
+    break;
+  case FLUSH_INTERVAL:
+    if (ctx->out_len == 0)
+      break;
+    now = stats_clock();
+    flush.ctx = ctx;
+    if (flush.since == 0)
+      flush.since = now;
+    else if (now - flush.since >= flush.interval)
+      out_flush(ctx);
+    break;
+  }
+}
+
+/* Milliseconds until the output waiting under --flush=interval is due,
+   or -1 if none is waiting */
+static int flush_timeout(void) {
+  unsigned long long waited;
+
+  if (flush.policy != FLUSH_INTERVAL || flush.since == 0 ||
+      flush.ctx->out_len == 0)
+    return -1;
+  waited = stats_clock() - flush.since;
+  if (waited >= flush.interval)
+    return 0;
+  return (int)((flush.interval - waited + 999999) / 1000000);
+}
+
+/* Write out --flush=interval output if it is due */
+static void flush_due(void) {
+  if (flush_timeout() == 0)
+    out_flush(flush.ctx);
+}
+
+/* About to wait on FD for input: if output is waiting for
+   --flush=interval, write it out when it falls due, unless input comes
+   first */
+static void flush_wait(int fd) {
+  int timeout = flush_timeout();
+  struct pollfd p;
+
+  if (timeout < 0)
+    return;
+  p.fd = fd;
+  p.events = POLLIN;
+  if (timeout == 0 || poll(&p, 1, timeout) == 0)
+    out_flush(flush.ctx);
+}
+
+/* Worker threads formatting a slice of a block give their contexts a
+   private buffer that grows instead of being flushed */
+static void out_grow(struct dcat_ctx *ctx, size_t n) {
+  size_t size = ctx->out_size * 2 > ctx->out_len + n ? ctx->out_size * 2
+                                                     : ctx->out_len + n;
+  char *buf = realloc(ctx->out, size);
+  if (!buf) {
+    fprintf(stderr, "%s: memory allocation failed\n", PACKAGE_NAME);
+    exit(1);
+  }
+  ctx->out = buf;
+  ctx->out_size = size;
+}
+
+/* Worker threads that run batches of independent jobs for the caller */
+static struct {
+  int workers; /* threads started, not counting the caller */
+#ifdef HAVE_PTHREAD
+  pthread_mutex_t lock;
+  pthread_cond_t start;
+  pthread_cond_t done;
+#endif
+  void (*run)(void *job);
+  char *jobs;
+  size_t job_size;
+  int job_count;
+  int next_job; /* next job nobody has taken yet */
+  int unfinished;
+} pool;
+
+#ifdef HAVE_PTHREAD
+/* Take jobs from the current batch until there are none left */
+static void pool_work(void) {
+  while (pool.next_job < pool.job_count) {
+    void *job = pool.jobs + pool.job_size * pool.next_job++;
+
+    pthread_mutex_unlock(&pool.lock);
+    pool.run(job);
+    pthread_mutex_lock(&pool.lock);
+    if (--pool.unfinished == 0)
+      pthread_cond_signal(&pool.done);
+  }
+}
+
+static void *pool_thread(void *arg) {
+  (void)arg;
+  pthread_mutex_lock(&pool.lock);
+  for (;;) {
+    while (pool.next_job >= pool.job_count)
+      pthread_cond_wait(&pool.start, &pool.lock);
+    pool_work();
+  }
+  return NULL;
+}
+#endif
+
+/* Start up to COUNT worker threads.  If threads are unavailable the pool
+   just stays smaller, down to no workers at all, and pool_run() does
+   the work itself.  */
+static void pool_start(int count) {
+#ifdef HAVE_PTHREAD
+  pthread_mutex_init(&pool.lock, NULL);
+  pthread_cond_init(&pool.start, NULL);
+  pthread_cond_init(&pool.done, NULL);
+  while (pool.workers < count) {
+    pthread_t thread;
+    if (pthread_create(&thread, NULL, pool_thread, NULL) != 0)
+      break;
+    pthread_detach(thread);
+    pool.workers++;
+  }
+#else
+  (void)count;
+#endif
+}
+
+/* Run RUN on each of the COUNT jobs of SIZE bytes at JOBS, on the workers
+   and the calling thread, and return once all of them are done */
+static void pool_run(void (*run)(void *), void *jobs, size_t size,
+                     int count) {
+  sigjmp_buf *jump = map_jump;
+
+  /* A fault in a job must not unwind the batch: see map_fault() */
+  map_jump = NULL;
+#ifdef HAVE_PTHREAD
+  if (pool.workers > 0) {
+    pthread_mutex_lock(&pool.lock);
+    pool.run = run;
+    pool.jobs = jobs;
+    pool.job_size = size;
+    pool.job_count = count;
+    pool.next_job = 0;
+    pool.unfinished = count;
+    pthread_cond_broadcast(&pool.start);
+    pool_work();
+    while (pool.unfinished > 0)
+      pthread_cond_wait(&pool.done, &pool.lock);
+    pthread_mutex_unlock(&pool.lock);
+  } else
+#endif
+    for (int i = 0; i < count; i++)
+      run((char *)jobs + size * i);
+  map_jump = jump;
+  map_check();
+}
+
+/* One slice of a hex dump block, formatted on its own */
+struct hex_job {
+  const unsigned char *data;
+  size_t length;
+  unsigned long long offset;
+  char *out;
+  size_t out_len;
+  size_t out_size;
+};
+static struct hex_job hex_jobs[MAX_THREADS];
+
+static void hex_job_run(void *arg) {
+  struct hex_job *job = arg;
+
+  job->out_len = 0;
+  for (size_t i = 0; i < job->length; i += 16) {
+    size_t row = job->length - i < 16 ? job->length - i : 16;
+    job->out_len += dcat_hex_row(job->out + job->out_len, job->data + i,
+                                 row, job->offset + i);
+  }
+}
+
+/* Hex dump a block of LENGTH bytes, splitting it into row-aligned slices
+   for the worker threads when it is big enough.  The slices are written
+   in order with one writev, so the output is the same as
+   dcat_hex_dump().  */
+static void hex_dump_block(struct dcat_ctx *ctx, const unsigned char *buffer,
+                           size_t length, unsigned long long offset,
+                           size_t buffer_size) {
+  /* Format at most a buffer's worth per batch to bound memory */
+  size_t batch = buffer_size / 16 * 16;
+  int slices = pool.workers + 1;
+
+  if (slices == 1 || length < MIN_PARALLEL_SIZE) {
+    dcat_hex_dump(ctx, buffer, length, offset);
+    return;
+  }
+
+  for (size_t done = 0; done < length; done += batch) {
+    size_t todo = length - done < batch ? length - done : batch;
+    size_t slice = (todo / 16 + slices - 1) / slices * 16;
+    struct iovec iov[MAX_THREADS];
+    int count = 0;
+
+    for (size_t start = 0; start < todo; start += slice) {
+      struct hex_job *job = &hex_jobs[count];
+      size_t len = todo - start < slice ? todo - start : slice;
+      size_t need = (len + 15) / 16 * DCAT_HEX_ROW_MAX;
+
+      if (job->out_size < need) {
+        char *out = realloc(job->out, need);
+        if (!out) {
+          /* Too little memory to go parallel: do this batch serially */
+          count = 0;
+          break;
+        }
+        job->out = out;
+        job->out_size = need;
+      }
+      job->data = buffer + done + start;
+      job->length = len;
+      job->offset = offset + done + start;
+      count++;
+    }
+
+    if (count == 0) {
+      dcat_hex_dump(ctx, buffer + done, todo, offset + done);
+      continue;
+    }
+
+    pool_run(hex_job_run, hex_jobs, sizeof hex_jobs[0], count);
+    out_flush(ctx);
+    out_drain();
+    for (int i = 0; i < count; i++) {
+      iov[i].iov_base = hex_jobs[i].out;
+      iov[i].iov_len = hex_jobs[i].out_len;
+    }
+    if (full_writev(STDOUT_FILENO, iov, count) != 0) {
+      fprintf(stderr, "%s: write error\n", PACKAGE_NAME);
+      exit(1);
+    }
+  }
+}
+
+/* What formatting a slice does to the numbering, counted in pass 1 of
+   format_block().  Only the blank lines it starts with depend on the
+   state it starts in.  */
+struct slice_summary {
+  unsigned long lead;    /* blank lines before the first line with text */
+  unsigned long numbers; /* line numbers used from that line on */
+  unsigned long trail;   /* blank lines after the last line with text */
+  int has_text;
+};
+
+/* One slice of a block for the parallel formatter */
+struct format_job {
+  const char *data;
+  size_t length;
+  size_t skip; /* bytes finishing a partial line, not counted */
+  struct slice_summary sum;
+  struct dcat_ctx ctx; /* the caller's, with this slice's starting state */
+  char *out;
+  size_t out_len;
+  size_t out_size;
+};
+static struct format_job format_jobs[MAX_THREADS];
+
+/* Line numbers -n uses for a run of RUN blank lines that follows text */
+static inline unsigned long blank_numbers(unsigned long run) {
+  if (!number_lines)
+    return 0;
+  return squeeze_blank ? run > 0 : run;
+}
+
+/* Pass 1: count what formatting a slice would do, without formatting */
+static void summarize_job(void *arg) {
+  struct format_job *job = arg;
+  struct slice_summary *sum = &job->sum;
+  const char *ptr = job->data + job->skip;
+  const char *end = job->data + job->length;
+  unsigned long run = 0;
+
+  memset(sum, 0, sizeof *sum);
+  while (ptr < end) {
+    const char *nl = memchr(ptr, '\n', end - ptr);
+
+    if (nl == ptr) {
+      run++;
+      ptr++;
+      continue;
+    }
+    if (sum->has_text) {
+      sum->numbers += blank_numbers(run);
+    } else {
+      sum->lead = run;
+      sum->has_text = 1;
+    }
+    run = 0;
+    if (number_lines || number_nonblank)
+      sum->numbers++;
+    if (!nl)
+      break;
+    ptr = nl + 1;
+  }
+
+  if (sum->has_text) {
+    sum->numbers += blank_numbers(run);
+    sum->trail = run;
+  } else {
+    sum->lead = run;
+  }
+}
+
+/* Pass 2: format a slice into its private buffer */
+static void format_job_run(void *arg) {
+  struct format_job *job = arg;
+
+  job->ctx.out = job->out;
+  job->ctx.out_len = 0;
+  job->ctx.out_size = job->out_size;
+  job->ctx.room = out_grow;
+  job->ctx.write = NULL;
+  dcat_format(&job->ctx, job->data, job->length);
+  job->out = job->ctx.out;
+  job->out_len = job->ctx.out_len;
+  job->out_size = job->ctx.out_size;
+}
+
+/* Format a block, splitting it after newlines across the worker threads
+   when it is big enough.  Every slice but the first starts a line with no
+   CR pending, so all it needs to know is its first line number and how
+   many blank lines came just before it.  Pass 1 counts each slice in
+   parallel, a running sum over the counts gives every slice its starting
+   state, and pass 2 formats the slices in parallel into private buffers
+   that are written out in order.  */
+static void format_block(struct dcat_ctx *ctx, const char *buffer,
+                         size_t length, size_t buffer_size) {
+  struct dcat_state *state = &ctx->state;
+  int slices = pool.workers + 1;
+  size_t todo;
+
+  if (slices == 1 || length < MIN_PARALLEL_SIZE) {
+    dcat_format(ctx, buffer, length);
+    return;
+  }
+
+  /* Format at most a buffer's worth per batch to bound memory */
+  for (size_t done = 0; done < length; done += todo) {
+    const char *start = buffer + done;
+    const char *end;
+    struct iovec iov[MAX_THREADS];
+    unsigned long line, blanks;
+    int count = 0;
+
+    todo = length - done < buffer_size ? length - done : buffer_size;
+    end = start + todo;
+    while (start < end && count < slices) {
+      struct format_job *job = &format_jobs[count];
+      const char *cut = buffer + done + todo / slices * (count + 1);
+      size_t need;
+
+      if (count == slices - 1 || cut < start)
+        cut = count == slices - 1 ? end : start;
+      if (cut < end) {
+        const char *nl = memchr(cut, '\n', end - cut);
+        cut = nl ? nl + 1 : end;
+      }
+
+      need = (cut - start) + (cut - start) / 4 + 64;
+      if (job->out_size < need) {
+        char *out = realloc(job->out, need);
+        if (!out) {
+          count = 0;
+          break;
+        }
+        job->out = out;
+        job->out_size = need;
+      }
+      job->data = start;
+      job->length = cut - start;
+      job->skip = 0;
+      start = cut;
+      count++;
+    }
+
+    if (count <= 1) {
+      /* One long line, or too little memory: nothing to split */
+      dcat_format(ctx, buffer + done, todo);
+      continue;
+    }
+
+    /* The first slice may open by finishing a line from earlier */
+    if (!state->last_char_was_newline) {
+      const char *nl = memchr(format_jobs[0].data, '\n',
+                              format_jobs[0].length);
+      format_jobs[0].skip = nl + 1 - format_jobs[0].data;
+    }
+    pool_run(summarize_job, format_jobs, sizeof format_jobs[0], count - 1);
+
+    format_jobs[0].ctx = *ctx;
+    line = state->line_num;
+    blanks = state->consecutive_blank_lines > 2
+                 ? 2
+                 : state->consecutive_blank_lines;
+    for (int i = 0; i < count - 1; i++) {
+      const struct slice_summary *sum = &format_jobs[i].sum;
+
+      if (number_lines && squeeze_blank)
+        line += blanks == 0 && sum->lead > 0;
+      else if (number_lines)
+        line += sum->lead;
+      line += sum->numbers;
+      if (sum->has_text)
+        blanks = sum->trail;
+      else
+        blanks += sum->lead;
+      if (blanks > 2)
+        blanks = 2;
+
+      format_jobs[i + 1].ctx = *ctx;
+      dcat_reset(&format_jobs[i + 1].ctx, line);
+      format_jobs[i + 1].ctx.state.consecutive_blank_lines = blanks;
+    }
+
+    pool_run(format_job_run, format_jobs, sizeof format_jobs[0], count);
+    *state = format_jobs[count - 1].ctx.state;
+
+    out_flush(ctx);
+    out_drain();
+    for (int i = 0; i < count; i++) {
+      iov[i].iov_base = format_jobs[i].out;
+      iov[i].iov_len = format_jobs[i].out_len;
+    }
+    if (full_writev(STDOUT_FILENO, iov, count) != 0) {
+      fprintf(stderr, "%s: write error\n", PACKAGE_NAME);
+      exit(1);
+    }
+  }
+}
+
+/* --progress state, across all the input files */
+static struct {
+  unsigned long long total; /* bytes expected, 0 if not known */
+  unsigned long long done;
+  unsigned long long started; /* when the run started, in ns */
+  unsigned long long last;    /* when the line was last updated */
+  int width;                  /* length of that line */
+} progress;
+
+/* A clock cheap enough to read after every block */
+static unsigned long long progress_clock(void) {
+  struct timespec ts;
+#ifdef CLOCK_MONOTONIC_COARSE
+  clock_gettime(CLOCK_MONOTONIC_COARSE, &ts);
+#else
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+#endif
+  return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/* Add up the sizes of the COUNT inputs in FILES, leaving the total unknown
+   if any of them is not a regular file */
+static void progress_start(char **files, int count) {
+  struct stat st;
+
+  progress.started = progress.last = progress_clock();
+  if (count == 0 && fstat(STDIN_FILENO, &st) == 0 && S_ISREG(st.st_mode))
+    progress.total = st.st_size;
+  for (int i = 0; i < count; i++) {
+    int ok = strcmp(files[i], "-") == 0 ? fstat(STDIN_FILENO, &st)
+                                        : stat(files[i], &st);
+    if (ok != 0 || !S_ISREG(st.st_mode)) {
+      progress.total = 0;
+      return;
+    }
+    progress.total += st.st_size;
+  }
+}
+
+/* Redraw the progress line; FILENAME is NULL for the final one */
+static void progress_print(const char *filename, unsigned long long now) {
+  double secs = (now - progress.started) / 1e9;
+  double rate = secs > 0 ? progress.done / secs : 0;
+  char line[256];
+  int len;
+
+  if (!filename) {
+    len = snprintf(line, sizeof line, "%s: %llu MB in %.1fs, %.1f MB/s",
+                   PACKAGE_NAME, progress.done >> 20, secs, rate / 1048576);
+  } else if (progress.total > 0 && progress.done <= progress.total) {
+    unsigned long eta =
+        rate > 0 ? (unsigned long)((progress.total - progress.done) / rate)
+                 : 0;
+    len = snprintf(line, sizeof line,
+                   "%s: %s: %llu of %llu MB (%d%%), %.1f MB/s, ETA "
+                   "%lu:%02lu:%02lu",
+                   PACKAGE_NAME, filename, progress.done >> 20,
+                   progress.total >> 20,
+                   (int)(progress.done * 100 / progress.total),
+                   rate / 1048576, eta / 3600, eta / 60 % 60, eta % 60);
+  } else {
+    len = snprintf(line, sizeof line, "%s: %s: %llu MB, %.1f MB/s",
+                   PACKAGE_NAME, filename, progress.done >> 20,
+                   rate / 1048576);
+  }
+  if (len >= (int)sizeof line)
+    len = sizeof line - 1;
+  /* Pad with blanks over whatever is left of a longer earlier line */
+  fprintf(stderr, "\r%s%*s%s", line,
+          progress.width > len ? progress.width - len : 0, "",
+          filename ? "" : "\n");
+  fflush(stderr);
+  progress.width = len;
+}
+
+/* Count N more bytes of FILENAME done, redrawing the progress line at most
+   every PROGRESS_INTERVAL so a slow terminal never holds up the copy */
+static void progress_add(const char *filename, size_t n) {
+  unsigned long long now;
+
+  if (!show_progress)
+    return;
+  progress.done += n;
+  now = progress_clock();
+  if (now - progress.last >= PROGRESS_INTERVAL) {
+    progress.last = now;
+    progress_print(filename, now);
+  }
+}
+
+/* End the progress line, if the run was long enough to show one */
+static void progress_finish(void) {
+  if (show_progress && progress.width > 0)
+    progress_print(NULL, progress_clock());
+}
+
+/* Pick the first in-kernel copy method worth trying for IN -> OUT,
+   or the one after AFTER if that method turned out not to work */
+static int zero_copy_method(const struct stat *in, const struct stat *out,
+                            int after) {
+  int in_file = S_ISREG(in->st_mode) || S_ISBLK(in->st_mode);
+  int any_pipe = S_ISFIFO(in->st_mode) || S_ISFIFO(out->st_mode);
+
+  switch (after) {
+  case ZC_NONE:
+    if (S_ISREG(in->st_mode) && S_ISREG(out->st_mode))
+      return ZC_COPY_FILE_RANGE;
+    /* fall through */
+  case ZC_COPY_FILE_RANGE:
+    if (in_file && (S_ISREG(out->st_mode) || S_ISSOCK(out->st_mode)))
+      return ZC_SENDFILE;
+    /* fall through */
+  case ZC_SENDFILE:
+    if (any_pipe)
+      return ZC_SPLICE;
+    /* fall through */
+  default:
+    return ZC_NONE;
+  }
+}
+
+/* Move up to LEN bytes from IN_FD to OUT_FD with METHOD */
+static ssize_t zero_copy_chunk(int method, int in_fd, int out_fd, size_t len) {
+  switch (method) {
+#ifdef HAVE_COPY_FILE_RANGE
+  case ZC_COPY_FILE_RANGE:
+    return copy_file_range(in_fd, NULL, out_fd, NULL, len, 0);
+#endif
+#ifdef HAVE_SENDFILE
+  case ZC_SENDFILE:
+    return sendfile(out_fd, in_fd, NULL, len);
+#endif
+#ifdef HAVE_SPLICE
+  case ZC_SPLICE:
+    return splice(in_fd, NULL, out_fd, NULL, len,
+                  SPLICE_F_MOVE | SPLICE_F_MORE);
+#endif
+  default:
+    errno = ENOSYS;
+    return -1;
+  }
+}
+
+#if defined(FICLONERANGE) && defined(HAVE_COPY_FILE_RANGE)
+/* Share LEN bytes of IN_FD at IN_POS with OUT_FD at OUT_POS */
+static int clone_range(int in_fd, int out_fd, off_t in_pos, off_t out_pos,
+                       off_t len) {
+  struct file_clone_range range;
+
+  if (len <= 0)
+    return -1; /* a length of 0 would mean up to EOF */
+  range.src_fd = in_fd;
+  range.src_offset = in_pos;
+  range.src_length = len;
+  range.dest_offset = out_pos;
+  return ioctl(out_fd, FICLONERANGE, &range);
+}
+
+/* Have the regular file OUT_FD share IN_FD's blocks, from both offsets on,
+   instead of copying them, as btrfs and XFS can.  Only whole blocks can be
+   shared, so bytes up to OUT_FD's next block boundary are copied first;
+   the unaligned tail is shared too if it ends both files, else it is left
+   to the caller.  Moves at most *LEFT bytes and brings it down by them.
+   Returns 1 if any bytes moved, 0 if none did.  */
+static int clone_blocks(int in_fd, int out_fd, const struct stat *in_st,
+                        const struct stat *out_st, const char *filename,
+                        unsigned long long *left) {
+  unsigned long long start = stats_mode ? stats_clock() : 0;
+  off_t block = out_st->st_blksize > in_st->st_blksize ? out_st->st_blksize
+                                                       : in_st->st_blksize;
+  off_t in_pos = lseek(in_fd, 0, SEEK_CUR);
+  off_t out_pos = lseek(out_fd, 0, SEEK_CUR);
+  off_t head, rest, len;
+  off_t moved = 0;
+  ssize_t n;
+
+  /* Neither sharing nor copy_file_range() will append */
+  if (in_pos < 0 || out_pos < 0 || block <= 0 || in_st->st_size <= in_pos ||
+      (fcntl(out_fd, F_GETFL) & O_APPEND))
+    return 0;
+  /* Blocks line up only if both offsets are as far into one */
+  if (in_pos % block != out_pos % block)
+    return 0;
+  rest = in_st->st_size - in_pos;
+  if ((unsigned long long)rest > *left)
+    rest = *left;
+  head = (block - out_pos % block) % block;
+  if (rest < head + block)
+    return 0;
+
+  /* Copy the head, so that the rest starts on a block */
+  for (; moved < head; moved += n) {
+    n = copy_file_range(in_fd, NULL, out_fd, NULL, head - moved, 0);
+    if (n <= 0)
+      break;
+  }
+  if (moved == head) {
+    len = rest - head;
+    if (in_pos + rest != in_st->st_size || out_pos + rest < out_st->st_size)
+      len -= len % block;
+    if (clone_range(in_fd, out_fd, in_pos + head, out_pos + head, len) != 0) {
+      /* Some file systems will not share a partial block at all */
+      if (len % block == 0 || clone_range(in_fd, out_fd, in_pos + head,
+                                          out_pos + head,
+                                          len -= len % block) != 0)
+        len = 0;
+    }
+    moved += len;
+  }
+  if (moved == 0)
+    return 0;
+
+  /* Sharing leaves the offsets where they were */
+  lseek(in_fd, in_pos + moved, SEEK_SET);
+  lseek(out_fd, out_pos + moved, SEEK_SET);
+  *left -= moved;
+  if (stats_mode) {
+    stats_write(moved, 0, start);
+    stats_add(ST_BYTES_IN, moved);
+  }
+  progress_add(filename, moved);
+  return 1;
+}
+#else
+static int clone_blocks(int in_fd, int out_fd, const struct stat *in_st,
+                        const struct stat *out_st, const char *filename,
+                        unsigned long long *left) {
+  (void)in_fd;
+  (void)out_fd;
+  (void)in_st;
+  (void)out_st;
+  (void)filename;
+  (void)left;
+  return 0;
+}
+#endif
+
+/* Copy IN_FD to OUT_FD without bouncing the data through user space, at
+   most *LEFT bytes, which is brought down by what has been copied.
+   Returns 0 once the whole input has been copied, or -1 if the caller
+   should copy whatever is left with read/write.  Every method advances
+   the file offsets, so falling back part way through loses nothing, and
+   real I/O errors are left for the fallback loop to report.  */
+static int zero_copy(int in_fd, int out_fd, const char *filename,
+                     size_t chunk, unsigned long long *left) {
+  struct stat in_st, out_st;
+  int method;
+  int copied = 0;
+
+  if (fstat(in_fd, &in_st) != 0 || fstat(out_fd, &out_st) != 0)
+    return -1;
+
+  method = zero_copy_method(&in_st, &out_st, ZC_NONE);
+  if (method == ZC_COPY_FILE_RANGE)
+    copied = clone_blocks(in_fd, out_fd, &in_st, &out_st, filename, left);
+  while (method != ZC_NONE) {
+    unsigned long long start = stats_mode ? stats_clock() : 0;
+    ssize_t n;
+
+    if (*left == 0)
+      return 0;
+    n = zero_copy_chunk(method, in_fd, out_fd,
+                        chunk < *left ? chunk : *left);
+
+    if (stats_mode && n >= 0) {
+      stats_write(n, 0, start); /* asked for CHUNK, but never short */
+      if (n > 0)
+        stats_add(ST_BYTES_IN, n);
+    }
+    if (n > 0) {
+      copied = 1;
+      *left -= n;
+      progress_add(filename, n);
+    } else if (n == 0) {
+      /* EOF, unless nothing moved at all: /proc and friends report a
+         size of 0 and only work with read */
+      return copied ? 0 : -1;
+    } else if (errno != EINTR) {
+      if (copied)
+        return -1;
+      method = zero_copy_method(&in_st, &out_st, method);
+    }
+  }
+  return -1;
+}
+
+/* A regular file being read through a sliding window of mappings */
+struct mapped_input {
+  int fd;
+  off_t pos;      /* next byte to hand out */
+  off_t end;      /* file size when mapping started */
+  size_t window;  /* bytes mapped per step, a multiple of the page size */
+  void *map;      /* current mapping, or NULL */
+  size_t map_len; /* length of the current mapping */
+};
+
+/* Start mapping FD from its current offset.  Returns 0 if the file can be
+   read with map_next(), -1 if it has to be read with read() instead.  */
+static int map_begin(struct mapped_input *in, int fd, size_t buffer_size) {
+#if defined(HAVE_MMAP)
+  struct stat st;
+  long page = sysconf(_SC_PAGESIZE);
+
+  if (fstat(fd, &st) != 0 || !S_ISREG(st.st_mode) || page <= 0)
+    return -1;
+
+  in->fd = fd;
+  in->pos = lseek(fd, 0, SEEK_CUR);
+  in->end = st.st_size;
+  in->map = NULL;
+  in->map_len = 0;
+  if (in->pos < 0 || in->end <= in->pos)
+    return -1;
+
+  /* Never map less than the read buffer would hold */
+  in->window = buffer_size > MMAP_WINDOW_SIZE ? buffer_size : MMAP_WINDOW_SIZE;
+  in->window = (in->window + page - 1) / page * page;
+  return 0;
+#else
+  (void)in;
+  (void)fd;
+  (void)buffer_size;
+  return -1;
+#endif
+}
+
+/* Map the next window of IN and point *DATA at it.  Returns the number of
+   bytes available, 0 at the end of the mapped range, or -1 if mapping
+   failed and the rest should be read with read().  Every window but the
+   last is a multiple of 16 bytes long, so hex dump rows never straddle
+   two of them.  */
+static ssize_t map_next(struct mapped_input *in, const char **data) {
+#if defined(HAVE_MMAP)
+  long page = sysconf(_SC_PAGESIZE);
+  off_t base = in->pos / page * page;
+  size_t skip = in->pos - base;
+  size_t len, avail;
+
+  if (in->map) {
+    map_guard(NULL, 0);
+    munmap(in->map, in->map_len);
+    in->map = NULL;
+  }
+  if (in->pos >= in->end)
+    return 0;
+
+  len = in->end - base < (off_t)in->window ? (size_t)(in->end - base)
+                                           : in->window;
+  in->map = mmap(NULL, len, PROT_READ, MAP_PRIVATE, in->fd, base);
+  if (in->map == MAP_FAILED) {
+    in->map = NULL;
+    return -1;
+  }
+  in->map_len = len;
+  map_guard(in->map, len);
+#ifdef HAVE_MADVISE
+  madvise(in->map, len, MADV_SEQUENTIAL);
+  madvise(in->map, len, MADV_WILLNEED);
+#endif
+
+  avail = len - skip;
+  if (base + (off_t)len < in->end)
+    avail -= avail % 16;
+  if (stats_mode) {
+    stats_add(ST_READS, 1);
+    stats_add(ST_BYTES_IN, avail);
+  }
+  *data = (const char *)in->map + skip;
+  in->pos += avail;
+  return avail;
+#else
+  (void)in;
+  (void)data;
+  return -1;
+#endif
+}
+
+/* Drop the last mapping and leave the file offset just past the bytes
+   that were handed out, so a read() loop can pick up anything left or
+   appended since.  */
+static void map_end(struct mapped_input *in) {
+#if defined(HAVE_MMAP)
+  if (in->map) {
+    map_guard(NULL, 0);
+    munmap(in->map, in->map_len);
+    in->map = NULL;
+  }
+  lseek(in->fd, in->pos, SEEK_SET);
+#else
+  (void)in;
+#endif
+}
+
+/* Compressed formats --decompress knows by their magic bytes */
+enum { DEC_NONE, DEC_GZIP, DEC_ZSTD };
+
+static const char *const format_names[] = {"plain", "gzip", "zstd"};
+
+/* Returned by source_next() for bad compressed data, already reported */
+#define DECODE_ERROR (-2)
+
+/* --decompress state for one input: the compressed bytes not decoded yet
+   are [IN + IN_POS, IN + IN_LEN), read into IN_BUFFER as needed or, for
+   zstd with --threads, all of the file mapped at once.  DEC_NONE passes
+   input that cannot be rewound through as it is.  */
+struct decoder {
+  int format;
+  int fd;
+  const char *name;
+  const char *in;
+  size_t in_pos;
+  size_t in_len;
+  char *in_buffer;
+  size_t in_size;
+  int eof;      /* nothing more to read after IN_LEN */
+  int finished; /* the compressed stream has ended */
+  void *map;
+  size_t map_len;
+#ifdef HAVE_ZLIB
+  z_stream z;
+  int member_end; /* a gzip member has ended; another may follow */
+#endif
+#ifdef HAVE_ZSTD
+  ZSTD_DStream *zstd;
+  int zstd_pending; /* a frame is started and not fully flushed */
+  int parallel;     /* decode whole frames on the thread pool */
+  int frames;       /* frames decoded in frame_jobs[] */
+  int next_frame;   /* the frame being handed out */
+  size_t frame_pos; /* bytes of it handed out so far */
+#endif
+};
+
+/* Where process_file() gets its input blocks: mmap windows while the
+   file can be mapped, then read() into a buffer, either on the spot or,
+   with --pipeline, by a reader thread filling a ring of buffers ahead of
+   the formatter.  With --decompress, compressed input is decoded into
+   the buffer instead.  */
+struct block_source {
+  int fd;
+  size_t size;
+  int whole;   /* fill whole blocks, so hex dump rows stay 16 bytes */
+  int mapping; /* still handing out mapped windows */
+  struct mapped_input map;
+  char *buffer;
+  struct decoder *decoder;
+  unsigned long long left; /* bytes still to hand out, for --length */
+  struct cache_trail trail;
+#ifdef HAVE_PTHREAD
+  int threaded;
+  pthread_t thread;
+  pthread_mutex_t lock;
+  pthread_cond_t filled;
+  pthread_cond_t freed;
+  ssize_t lens[MAX_PIPELINE];
+  int errors[MAX_PIPELINE];
+  int head;  /* next slot for the consumer */
+  int ready; /* slots filled and not released yet */
+  int held;  /* the consumer still holds the head slot */
+  int stop;  /* the consumer is done, the reader should quit */
+#endif
+};
+
+/* Return the format whose magic bytes start the LEN bytes at DATA */
+static int compressed_format(const unsigned char *data, size_t len) {
+  if (len >= 2 && data[0] == 0x1f && data[1] == 0x8b)
+    return DEC_GZIP;
+  /* A zstd frame, or a skippable frame, 0x184D2A50 to 0x184D2A5F */
+  if (len >= 4 && ((data[0] == 0x28 && data[1] == 0xb5 && data[2] == 0x2f &&
+                    data[3] == 0xfd) ||
+                   ((data[0] & 0xf0) == 0x50 && data[1] == 0x2a &&
+                    data[2] == 0x4d && data[3] == 0x18)))
+    return DEC_ZSTD;
+  return DEC_NONE;
+}
+
+#ifdef HAVE_ZSTD
+/* A zstd frame decoded on its own by a --threads worker */
+struct frame_job {
+  const char *src;
+  size_t src_len;
+  char *out;
+  size_t out_size;
+  size_t result; /* bytes decoded, or a zstd error code */
+};
+static struct frame_job frame_jobs[MAX_THREADS];
+static THREAD_LOCAL ZSTD_DCtx *frame_context;
+
+static void frame_job_run(void *arg) {
+  struct frame_job *job = arg;
+
+  if (!frame_context && !(frame_context = ZSTD_createDCtx())) {
+    job->result = (size_t)-1; /* ZSTD_error_GENERIC */
+    return;
+  }
+  job->result = ZSTD_decompressDCtx(frame_context, job->out, job->out_size,
+                                    job->src, job->src_len);
+}
+
+/* Map the rest of D's file, so its frames can be found and handed to
+   several threads.  D->IN holds what was read to find the magic bytes.
+   Returns 0 on success.  */
+static int decoder_map(struct decoder *d) {
+#ifdef HAVE_MMAP
+  struct stat st;
+  long page = sysconf(_SC_PAGESIZE);
+  off_t pos = lseek(d->fd, 0, SEEK_CUR);
+  off_t start, base;
+
+  if (pos < 0 || fstat(d->fd, &st) != 0 || !S_ISREG(st.st_mode) ||
+      page <= 0)
+    return -1;
+  start = pos - (off_t)d->in_len;
+  if (st.st_size <= start)
+    return -1;
+  base = start / page * page;
+  d->map_len = st.st_size - base;
+  d->map = mmap(NULL, d->map_len, PROT_READ, MAP_PRIVATE, d->fd, base);
+  if (d->map == MAP_FAILED) {
+    d->map = NULL;
+    return -1;
+  }
+  map_guard(d->map, d->map_len);
+#ifdef HAVE_MADVISE
+  madvise(d->map, d->map_len, MADV_SEQUENTIAL);
+#endif
+  if (stats_mode)
+    stats_add(ST_BYTES_IN, st.st_size - pos);
+  d->in = (const char *)d->map + (start - base);
+  d->in_len = st.st_size - start;
+  d->eof = 1;
+  return 0;
+#else
+  (void)d;
+  return -1;
+#endif
+}
+
+/* Decode the next frames of a mapped file, one per thread.  Returns the
+   number of frames decoded, 0 if the next frame cannot be decoded whole
+   and has to be streamed, or -1 on an error (reported).  */
+static int decode_frames(struct decoder *d) {
+  int count = 0;
+
+  while (count < thread_count && d->in_pos < d->in_len) {
+    const char *src = d->in + d->in_pos;
+    size_t len = ZSTD_findFrameCompressedSize(src, d->in_len - d->in_pos);
+    unsigned long long size;
+    struct frame_job *job = &frame_jobs[count];
+
+    if (ZSTD_isError(len))
+      break;
+    size = ZSTD_getFrameContentSize(src, len);
+    if (size == ZSTD_CONTENTSIZE_UNKNOWN || size == ZSTD_CONTENTSIZE_ERROR ||
+        size > MAX_FRAME_SIZE)
+      break;
+    if (job->out_size < size || !job->out) {
+      char *out = realloc(job->out, size ? size : 1);
+      if (!out)
+        break;
+      job->out = out;
+      job->out_size = size ? size : 1;
+    }
+    job->src = src;
+    job->src_len = len;
+    d->in_pos += len;
+    count++;
+  }
+  if (count == 0)
+    return 0;
+
+  pool_run(frame_job_run, frame_jobs, sizeof frame_jobs[0], count);
+  for (int i = 0; i < count; i++) {
+    if (ZSTD_isError(frame_jobs[i].result)) {
+      fprintf(stderr, "%s: %s: %s\n", PACKAGE_NAME, d->name,
+              ZSTD_getErrorName(frame_jobs[i].result));
+      return -1;
+    }
+  }
+  d->frames = count;
+  d->next_frame = 0;
+  d->frame_pos = 0;
+  return count;
+}
+
+/* Decode zstd data from D into OUT.  Returns the bytes decoded, which
+   is 0 only if more input is needed, or -1 on an error (reported).  */
+static ssize_t zstd_step(struct decoder *d, char *out, size_t size) {
+  ZSTD_inBuffer in = {d->in, d->in_len, d->in_pos};
+  ZSTD_outBuffer o = {out, size, 0};
+  size_t r;
+
+  while (d->parallel) {
+    if (d->next_frame < d->frames) {
+      struct frame_job *job = &frame_jobs[d->next_frame];
+      size_t n = job->result - d->frame_pos;
+
+      if (n > size)
+        n = size;
+      memcpy(out, job->out + d->frame_pos, n);
+      d->frame_pos += n;
+      if (d->frame_pos == job->result) {
+        d->next_frame++;
+        d->frame_pos = 0;
+      }
+      if (n > 0)
+        return n;
+      continue;
+    }
+    if (d->in_pos == d->in_len) {
+      d->finished = 1;
+      return 0;
+    }
+    switch (decode_frames(d)) {
+    case -1:
+      return -1;
+    case 0:
+      d->parallel = 0; /* stream the rest from here */
+      in.pos = d->in_pos;
+      break;
+    }
+  }
+
+  r = ZSTD_decompressStream(d->zstd, &o, &in);
+  if (ZSTD_isError(r)) {
+    fprintf(stderr, "%s: %s: %s\n", PACKAGE_NAME, d->name,
+            ZSTD_getErrorName(r));
+    return -1;
+  }
+  /* Between frames, with no input, R is a hint for the next header */
+  if (in.pos != d->in_pos || o.pos > 0)
+    d->zstd_pending = r != 0;
+  d->in_pos = in.pos;
+  if (o.pos == 0 && d->in_pos == d->in_len && d->eof) {
+    if (d->zstd_pending) {
+      fprintf(stderr, "%s: %s: unexpected end of zstd data\n", PACKAGE_NAME,
+              d->name);
+      return -1;
+    }
+    d->finished = 1;
+  }
+  return o.pos;
+}
+#endif
+
+#ifdef HAVE_ZLIB
+/* Decode gzip data from D into OUT, going on to the next member after
+   one ends and ignoring anything else after the last.  Returns the bytes
+   decoded, which is 0 only if more input is needed, or -1 on an error
+   (reported).  */
+static ssize_t gzip_step(struct decoder *d, char *out, size_t size) {
+  int r;
+
+  if (d->member_end) {
+    if (d->in_pos == d->in_len) {
+      d->finished = d->eof;
+      return 0;
+    }
+    if ((unsigned char)d->in[d->in_pos] != 0x1f) {
+      d->finished = 1;
+      return 0;
+    }
+    inflateReset(&d->z);
+    d->member_end = 0;
+  }
+
+  d->z.next_in = (Bytef *)d->in + d->in_pos;
+  d->z.avail_in = d->in_len - d->in_pos;
+  d->z.next_out = (Bytef *)out;
+  d->z.avail_out = size > UINT_MAX ? UINT_MAX : size;
+  r = inflate(&d->z, Z_NO_FLUSH);
+  d->in_pos = d->in_len - d->z.avail_in;
+  size = (Bytef *)d->z.next_out - (Bytef *)out;
+
+  if (r == Z_STREAM_END) {
+    d->member_end = 1;
+  } else if (r != Z_OK && r != Z_BUF_ERROR) {
+    fprintf(stderr, "%s: %s: %s\n", PACKAGE_NAME, d->name,
+            d->z.msg ? d->z.msg : "invalid gzip data");
+    return -1;
+  } else if (size == 0 && d->in_pos == d->in_len && d->eof) {
+    fprintf(stderr, "%s: %s: unexpected end of gzip data\n", PACKAGE_NAME,
+            d->name);
+    return -1;
+  }
+  return size;
+}
+#endif
+
+/* Look at the start of FD for the magic bytes of a compressed format,
+   reading IN_SIZE bytes at a time.  Returns 1 if the input has to go
+   through D, 0 if it can be read as it is from where it was, or -1 on an
+   error (reported).  */
+static int decoder_open(struct decoder *d, int fd, const char *filename,
+                        size_t in_size) {
+  ssize_t n = 0;
+
+  memset(d, 0, sizeof *d);
+  d->fd = fd;
+  d->name = filename;
+  d->in_size = in_size;
+  d->in_buffer = buffer_get(in_size);
+  if (!d->in_buffer) {
+    fprintf(stderr, "%s: memory allocation failed\n", PACKAGE_NAME);
+    return -1;
+  }
+  d->in = d->in_buffer;
+  while (d->in_len < 4 &&
+         (n = safe_read(fd, d->in_buffer + d->in_len, in_size - d->in_len)) >
+             0)
+    d->in_len += n;
+  if (n < 0) {
+    fprintf(stderr, "%s: %s: %s\n", PACKAGE_NAME, filename, strerror(errno));
+    buffer_put(d->in_buffer);
+    return -1;
+  }
+  d->eof = n == 0;
+  d->format = compressed_format((const unsigned char *)d->in, d->in_len);
+
+  switch (d->format) {
+  case DEC_NONE:
+    /* Give regular files back to the usual zero-copy and mmap paths */
+    if (lseek(fd, -(off_t)d->in_len, SEEK_CUR) >= 0) {
+      buffer_put(d->in_buffer);
+      return 0;
+    }
+    return 1;
+#ifdef HAVE_ZLIB
+  case DEC_GZIP:
+    /* 16 + MAX_WBITS: a gzip header and trailer, not a zlib one */
+    if (inflateInit2(&d->z, 16 + MAX_WBITS) != Z_OK)
+      break;
+    return 1;
+#endif
+#ifdef HAVE_ZSTD
+  case DEC_ZSTD:
+    d->zstd = ZSTD_createDStream();
+    if (!d->zstd || ZSTD_isError(ZSTD_initDStream(d->zstd)))
+      break;
+    d->parallel = thread_count > 1 && !no_cache && decoder_map(d) == 0;
+    return 1;
+#endif
+  default:
+    fprintf(stderr, "%s: %s: cannot decompress %s data: not built with "
+            "%s support\n", PACKAGE_NAME, filename, format_names[d->format],
+            format_names[d->format]);
+    buffer_put(d->in_buffer);
+    return -1;
+  }
+
+  fprintf(stderr, "%s: memory allocation failed\n", PACKAGE_NAME);
+#ifdef HAVE_ZSTD
+  ZSTD_freeDStream(d->zstd);
+#endif
+  buffer_put(d->in_buffer);
+  return -1;
+}
+
+/* Decode D into the SIZE bytes at OUT, filling all of it unless the
+   input ends first when WHOLE is set.  Returns the length, 0 at the end,
+   -1 on a read error or DECODE_ERROR on bad compressed data.  */
+static ssize_t decoder_fill(struct decoder *d, char *out, size_t size,
+                            int whole) {
+  size_t len = 0;
+
+  while (len < size && !d->finished) {
+    ssize_t n;
+
+    if (d->in_pos == d->in_len && !d->eof) {
+      n = safe_read(d->fd, d->in_buffer, d->in_size);
+      if (n < 0)
+        return -1;
+      d->in = d->in_buffer;
+      d->in_pos = 0;
+      d->in_len = n;
+      d->eof = n == 0;
+    }
+
+    switch (d->format) {
+#ifdef HAVE_ZLIB
+    case DEC_GZIP:
+      n = gzip_step(d, out + len, size - len);
+      break;
+#endif
+#ifdef HAVE_ZSTD
+    case DEC_ZSTD:
+      n = zstd_step(d, out + len, size - len);
+      break;
+#endif
+    default:
+      n = d->in_len - d->in_pos < size - len ? d->in_len - d->in_pos
+                                             : size - len;
+      memcpy(out + len, d->in + d->in_pos, n);
+      d->in_pos += n;
+      d->finished = d->eof && d->in_pos == d->in_len;
+      break;
+    }
+    if (n < 0)
+      return DECODE_ERROR;
+    len += n;
+    if (!whole && len > 0)
+      break;
+  }
+  return len;
+}
+
+/* decoder_fill(), with a file truncated under D's mapping reported as
+   such instead of killing us with SIGBUS */
+static ssize_t decoder_next(struct decoder *d, char *out, size_t size,
+                            int whole) {
+  sigjmp_buf jump;
+  ssize_t n;
+
+  if (!d->map)
+    return decoder_fill(d, out, size, whole);
+  if (sigsetjmp(jump, 1) != 0) {
+    map_disarm();
+    fprintf(stderr, "%s: %s: file truncated\n", PACKAGE_NAME, d->name);
+    return DECODE_ERROR;
+  }
+  map_arm(&jump);
+  n = decoder_fill(d, out, size, whole);
+  map_disarm();
+  return n;
+}
+
+static void decoder_close(struct decoder *d) {
+#ifdef HAVE_ZLIB
+  if (d->format == DEC_GZIP)
+    inflateEnd(&d->z);
+#endif
+#ifdef HAVE_ZSTD
+  if (d->format == DEC_ZSTD)
+    ZSTD_freeDStream(d->zstd);
+#endif
+#ifdef HAVE_MMAP
+  if (d->map) {
+    map_guard(NULL, 0);
+    munmap(d->map, d->map_len);
+  }
+#endif
+  buffer_put(d->in_buffer);
+}
+
+/* Options for source_open() */
+#define SOURCE_MAP 1   /* read regular files through mmap */
+#define SOURCE_WHOLE 2 /* only short blocks at end of input */
+
+#ifdef HAVE_PTHREAD
+/* Read buffers of the --pipeline ring */
+static char *ring_buffers[MAX_PIPELINE];
+
+static void *reader_thread(void *arg) {
+  struct block_source *src = arg;
+  unsigned long long left = src->left; /* still to read, ahead of SRC */
+  ssize_t n;
+
+  pthread_mutex_lock(&src->lock);
+  do {
+    while (src->ready == pipeline_depth && !src->stop)
+      pthread_cond_wait(&src->freed, &src->lock);
+    if (src->stop)
+      break;
+    int slot = (src->head + src->ready) % pipeline_depth;
+    size_t len = src->size < left ? src->size : left;
+    pthread_mutex_unlock(&src->lock);
+
+    if (len == 0)
+      n = 0;
+    else if (src->whole)
+      n = full_read(src->fd, ring_buffers[slot], len);
+    else
+      n = safe_read(src->fd, ring_buffers[slot], len);
+    if (n > 0)
+      left -= n;
+
+    pthread_mutex_lock(&src->lock);
+    src->lens[slot] = n;
+    src->errors[slot] = errno;
+    src->ready++;
+    pthread_cond_signal(&src->filled);
+  } while (n > 0);
+  pthread_mutex_unlock(&src->lock);
+  return NULL;
+}
+
+/* Start a reader thread for SRC.  Returns 0 on success.  */
+static int reader_start(struct block_source *src) {
+  for (int i = 0; i < pipeline_depth; i++) {
+    if (!(ring_buffers[i] = buffer_get(src->size))) {
+      while (i > 0)
+        buffer_put(ring_buffers[--i]);
+      return -1;
+    }
+  }
+  src->head = src->ready = src->held = src->stop = 0;
+  pthread_mutex_init(&src->lock, NULL);
+  pthread_cond_init(&src->filled, NULL);
+  pthread_cond_init(&src->freed, NULL);
+  if (pthread_create(&src->thread, NULL, reader_thread, src) != 0) {
+    for (int i = 0; i < pipeline_depth; i++)
+      buffer_put(ring_buffers[i]);
+    return -1;
+  }
+  src->threaded = 1;
+  return 0;
+}
+
+/* Release the slot handed out last and wait for the next one */
+static ssize_t reader_next(struct block_source *src, const char **data) {
+  ssize_t n;
+
+  pthread_mutex_lock(&src->lock);
+  if (src->held) {
+    src->head = (src->head + 1) % pipeline_depth;
+    src->ready--;
+    src->held = 0;
+    pthread_cond_signal(&src->freed);
+  }
+  while (src->ready == 0) {
+    int timeout = flush_timeout();
+    struct timespec ts;
+
+    if (timeout < 0) {
+      pthread_cond_wait(&src->filled, &src->lock);
+      continue;
+    }
+    /* --flush=interval: wake up for output falling due before input */
+    clock_gettime(CLOCK_REALTIME, &ts);
+    ts.tv_sec += timeout / 1000;
+    ts.tv_nsec += timeout % 1000 * 1000000L;
+    if (ts.tv_nsec >= 1000000000L) {
+      ts.tv_sec++;
+      ts.tv_nsec -= 1000000000L;
+    }
+    if (pthread_cond_timedwait(&src->filled, &src->lock, &ts) == ETIMEDOUT) {
+      pthread_mutex_unlock(&src->lock);
+      flush_due();
+      pthread_mutex_lock(&src->lock);
+    }
+  }
+  n = src->lens[src->head];
+  errno = src->errors[src->head];
+  *data = ring_buffers[src->head];
+  src->held = n > 0;
+  pthread_mutex_unlock(&src->lock);
+  return n;
+}
+
+/* Stop the reader thread and wait for it to exit */
+static void reader_stop(struct block_source *src) {
+  pthread_mutex_lock(&src->lock);
+  src->stop = 1;
+  pthread_cond_signal(&src->freed);
+  pthread_mutex_unlock(&src->lock);
+  pthread_join(src->thread, NULL);
+  pthread_cond_destroy(&src->filled);
+  pthread_cond_destroy(&src->freed);
+  pthread_mutex_destroy(&src->lock);
+  for (int i = 0; i < pipeline_depth; i++)
+    buffer_put(ring_buffers[i]);
+}
+#endif
+
+/* Get ready to read at most LEFT bytes of FD in blocks of SIZE bytes,
+   through DECODER if it is not NULL, which is then closed with SRC.
+   Returns 0 on success, -1 if no buffer could be allocated.  */
+static int source_open(struct block_source *src, int fd, size_t size,
+                       int flags, struct decoder *decoder,
+                       unsigned long long left) {
+  src->fd = fd;
+  src->size = size;
+  src->left = left;
+  src->trail.start = -1;
+  if (no_cache) {
+    /* Mappings read through the page cache, which is to be kept clear */
+    flags &= ~SOURCE_MAP;
+    cache_trail_init(&src->trail, fd);
+  }
+  src->whole = (flags & SOURCE_WHOLE) != 0;
+  src->mapping = 0;
+  src->buffer = NULL;
+  src->decoder = decoder;
+  if (decoder) {
+#ifdef HAVE_PTHREAD
+    src->threaded = 0;
+#endif
+    src->buffer = buffer_get(size);
+    if (src->buffer)
+      return 0;
+    decoder_close(decoder);
+    return -1;
+  }
+#ifdef HAVE_PTHREAD
+  src->threaded = 0;
+  /* The reader thread is there to hide I/O latency, which page faults on
+     a mapping would bring straight back to the formatter */
+  if (pipeline_depth > 1 && reader_start(src) == 0)
+    return 0;
+#endif
+  if ((flags & SOURCE_MAP) && map_begin(&src->map, fd, size) == 0) {
+    /* Map no further than --length goes */
+    if ((unsigned long long)(src->map.end - src->map.pos) > left)
+      src->map.end = src->map.pos + left;
+    src->mapping = 1;
+    return 0;
+  }
+  src->buffer = buffer_get(size);
+  return src->buffer ? 0 : -1;
+}
+
+/* Drop SRC's mapping and read() the rest */
+static int source_unmap(struct block_source *src) {
+  map_end(&src->map);
+  src->mapping = 0;
+  src->buffer = buffer_get(src->size);
+  if (!src->buffer) {
+    errno = ENOMEM;
+    return -1;
+  }
+  return 0;
+}
+
+/* Read the next block for source_next() */
+static ssize_t source_block(struct block_source *src, const char **data) {
+  size_t len;
+
+  if (src->decoder) {
+    *data = src->buffer;
+    return decoder_next(src->decoder, src->buffer, src->size, src->whole);
+  }
+  if (src->mapping) {
+    ssize_t n = map_next(&src->map, data);
+    if (n > 0)
+      return n;
+    /* Past the mapped size, or mapping failed: read() the rest */
+    if (source_unmap(src) != 0)
+      return -1;
+  }
+#ifdef HAVE_PTHREAD
+  if (src->threaded)
+    return reader_next(src, data);
+#endif
+  /* Read no further than --length goes, leaving the rest of a pipe for
+     whoever reads it next */
+  len = src->size < src->left ? src->size : src->left;
+  *data = src->buffer;
+  flush_wait(src->fd);
+  if (src->whole)
+    return full_read(src->fd, src->buffer, len);
+  return safe_read(src->fd, src->buffer, len);
+}
+
+/* Point *DATA at the next block.  Returns its length, 0 at end of input,
+   or -1 with errno set on a read error.  The previous block is no longer
+   valid once this is called.  */
+static ssize_t source_next(struct block_source *src, const char **data) {
+  ssize_t n;
+
+  if (src->left == 0)
+    return 0;
+  n = source_block(src, data);
+  if (n > 0 && !src->decoder)
+    cache_trail_add(&src->trail, src->fd, n, 0);
+  if (n > 0) {
+    if ((unsigned long long)n > src->left)
+      n = src->left;
+    src->left -= n;
+  }
+  return n;
+}
+
+/* Read and drop the first N bytes of FD, or of what DECODER decodes from
+   it, for --offset on input that cannot seek.  Reads never ask for more
+   than is left to drop, so nothing past the offset is lost.  Returns 0 on
+   success or the failed read's result.  */
+static ssize_t skip_input(int fd, struct decoder *decoder,
+                          unsigned long long n) {
+  char *scratch = buffer_get(DEFAULT_FORMAT_SIZE);
+  ssize_t r = 0;
+
+  if (!scratch) {
+    errno = ENOMEM;
+    return -1;
+  }
+  while (n > 0) {
+    size_t len = n < DEFAULT_FORMAT_SIZE ? n : DEFAULT_FORMAT_SIZE;
+
+    r = decoder ? decoder_next(decoder, scratch, len, 0)
+                : safe_read(fd, scratch, len);
+    if (r <= 0)
+      break;
+    n -= r;
+  }
+  buffer_put(scratch);
+  return r < 0 ? r : 0;
+}
+
+/* Hex dump or format the block of N bytes at DATA that SRC handed out,
+   its first byte at OFFSET in the file.  If the file is truncated under
+   SRC's mapping, the block ends at the page the file now ends in, and the
+   rest of the file is read() from after the block, as it would have been
+   had it been read() all along.  Returns 0, or -1 with errno set if no
+   buffer could be allocated for that.  */
+static int source_format(struct block_source *src, struct dcat_ctx *ctx,
+                         const char *data, size_t n,
+                         unsigned long long offset, size_t buffer_size) {
+  sigjmp_buf jump;
+
+  if (src->mapping) {
+    if (sigsetjmp(jump, 1) != 0) {
+      map_disarm();
+      return source_unmap(src);
+    }
+    map_arm(&jump);
+  }
+  if (hex_dump_mode)
+    hex_dump_block(ctx, (const unsigned char *)data, n, offset, buffer_size);
+  else
+    format_block(ctx, data, n, buffer_size);
+  map_disarm();
+  return 0;
+}
+
+/* Release everything source_open() set up */
+static void source_close(struct block_source *src) {
+  if (src->decoder)
+    decoder_close(src->decoder);
+  else
+    cache_trail_end(&src->trail, src->fd);
+  if (src->mapping)
+    map_end(&src->map);
+#ifdef HAVE_PTHREAD
+  if (src->threaded)
+    reader_stop(src);
+#endif
+  buffer_put(src->buffer);
+}
+
+/* Nonzero when no option changes the bytes being copied */
+static int plain_copy(void) {
+  return !hex_dump_mode && !show_all && !number_nonblank && !show_ends &&
+         !number_lines && !squeeze_blank && !show_tabs && !show_nonprinting;
+}
+
+/* Block size for formatting and hex dumps: half the L2 cache, leaving the
+   other half for the output, per thread working on the block */
+static size_t format_buffer_size(void) {
+  static size_t size;
+
+  if (size == 0) {
+    long cache = -1;
+#ifdef _SC_LEVEL2_CACHE_SIZE
+    cache = sysconf(_SC_LEVEL2_CACHE_SIZE);
+#endif
+    size = cache > 0 ? (size_t)cache / 2 : DEFAULT_FORMAT_SIZE;
+    if (size < MIN_FORMAT_SIZE)
+      size = MIN_FORMAT_SIZE;
+    size *= thread_count;
+    if (size > DEFAULT_BUFFER_SIZE)
+      size = DEFAULT_BUFFER_SIZE;
+  }
+  return size;
+}
+
+/* Buffer size for reading FD: --buffer-size if given, otherwise the whole
+   file in st_blksize units up to DEFAULT_BUFFER_SIZE for plain copies, at
+   most a cache-sized block when formatting, and the pipe capacity for a
+   pipe, since a read never returns more than that */
+static size_t input_buffer_size(int fd) {
+  size_t limit = plain_copy() ? DEFAULT_BUFFER_SIZE : format_buffer_size();
+  struct stat st;
+
+  if (custom_buffer_size > 0)
+    return custom_buffer_size;
+  if (fstat(fd, &st) != 0)
+    return limit;
+
+  if (S_ISREG(st.st_mode) && st.st_size > 0) {
+    size_t block = st.st_blksize >= 1024 ? (size_t)st.st_blksize : 4096;
+    if ((unsigned long long)st.st_size >= limit)
+      return limit;
+    /* Round up so the read that finds EOF needs no second buffer */
+    return ((size_t)st.st_size + block) / block * block;
+  }
+#ifdef F_GETPIPE_SZ
+  if (S_ISFIFO(st.st_mode)) {
+    int pipe_size = fcntl(fd, F_GETPIPE_SZ);
+    if (pipe_size >= 1024 && (size_t)pipe_size < limit)
+      return pipe_size;
+  }
+#endif
+  return limit;
+}
+
+/* Size of the output buffer, which lives for the whole run */
+static size_t output_buffer_size(void) {
+  if (custom_buffer_size > 0)
+    return custom_buffer_size;
+  return plain_copy() ? DEFAULT_BUFFER_SIZE : format_buffer_size();
+}
+
+/* Let a pipe on stdout hold more, so each write moves more at once */
+static void grow_output_pipe(void) {
+#if defined(F_GETPIPE_SZ) && defined(F_SETPIPE_SZ)
+  struct stat st;
+  int size = output_buffer_size() < PIPE_OUTPUT_SIZE ? output_buffer_size()
+                                                     : PIPE_OUTPUT_SIZE;
+
+  if (fstat(STDOUT_FILENO, &st) == 0 && S_ISFIFO(st.st_mode) &&
+      fcntl(STDOUT_FILENO, F_GETPIPE_SZ) < size)
+    fcntl(STDOUT_FILENO, F_SETPIPE_SZ, size); /* may fail; that is fine */
+#endif
+}
+
+/* Report source_next() failing with N on FILENAME, unless the decoder has
+   already, after the output buffered in CTX so far; returns 1 */
+static int read_error(struct dcat_ctx *ctx, const char *filename,
+                      ssize_t n) {
+  int error = errno;
+
+  out_flush(ctx);
+  out_drain();
+  if (n != DECODE_ERROR)
+    fprintf(stderr, "%s: %s: %s\n", PACKAGE_NAME, filename, strerror(error));
+  return 1;
+}
+
+/* Report running out of memory for a file, after the output buffered in
+   CTX so far; returns 1 */
+static int alloc_error(struct dcat_ctx *ctx) {
+  out_flush(ctx);
+  out_drain();
+  fprintf(stderr, "%s: memory allocation failed\n", PACKAGE_NAME);
+  return 1;
+}
+
+/* Nonzero if FD is a regular file */
+static int regular_file(int fd) {
+  struct stat st;
+
+  return fstat(fd, &st) == 0 && S_ISREG(st.st_mode);
+}
+
+/* Process a file or stdin */
+static int process_file(int fd, const char *filename,
+                        struct dcat_ctx *ctx) {
+  size_t buffer_size = input_buffer_size(fd);
+  struct block_source src;
+  struct decoder decoder, *decoding = NULL;
+  unsigned long long left = range_length;
+  const char *data;
+  ssize_t bytes_read;
+
+#ifdef O_DIRECT
+  /* --no-cache: read files of our own straight from the device, into
+     the page-aligned pool buffers; safe_read() turns this off again if
+     the file system or the block size will not have it.  Standard input
+     is left alone, as its flags are shared with whoever opened it.  */
+  if (no_cache && fd != STDIN_FILENO) {
+    int flags = fcntl(fd, F_GETFL);
+    if (flags >= 0)
+      fcntl(fd, F_SETFL, flags | O_DIRECT);
+  }
+#endif
+
+  if (decompress_mode) {
+    switch (decoder_open(&decoder, fd, filename, buffer_size)) {
+    case -1:
+      return 1;
+    case 1:
+      decoding = &decoder;
+      /* The buffers hold decoded data, so size them for that */
+      if (custom_buffer_size == 0)
+        buffer_size = output_buffer_size();
+      break;
+    }
+  }
+
+  /* --offset: seek past the start where possible, else read past it */
+  if (range_offset > 0 &&
+      (decoding || lseek(fd, (off_t)range_offset, SEEK_CUR) < 0)) {
+    bytes_read = skip_input(fd, decoding, range_offset);
+    if (bytes_read < 0) {
+      if (decoding)
+        decoder_close(decoding);
+      return read_error(ctx, filename, bytes_read);
+    }
+  }
+  /* A short --length needs no more than a page or so of buffer */
+  if (left < buffer_size && (left / 4096 + 1) * 4096 < buffer_size)
+    buffer_size = (left / 4096 + 1) * 4096;
+
+  /* Hex dump mode - takes precedence over all other options */
+  if (hex_dump_mode) {
+    unsigned long long offset = range_offset; /* rows show file offsets */
+
+    /* Fill whole blocks of whole rows so rows only come up short at the
+       very end */
+    buffer_size &= ~(size_t)15;
+    if (out_init(ctx, output_buffer_size()) != 0) {
+      if (decoding)
+        decoder_close(decoding);
+      return alloc_error(ctx);
+    }
+    /* source_open() closes DECODING itself if it fails */
+    if (source_open(&src, fd, buffer_size, SOURCE_MAP | SOURCE_WHOLE, decoding,
+                    left) != 0)
+      return alloc_error(ctx);
+
+    while ((bytes_read = source_next(&src, &data)) > 0) {
+      unsigned long long start = format_start();
+      if (source_format(&src, ctx, data, bytes_read, offset, buffer_size)) {
+        bytes_read = -1;
+        break;
+      }
+      format_timed(start);
+      offset += bytes_read;
+      out_block(ctx);
+      progress_add(filename, bytes_read);
+    }
+
+    source_close(&src);
+    if (bytes_read < 0)
+      return read_error(ctx, filename, bytes_read);
+    return 0;
+  }
+
+  /* No options enabled */
+  if (plain_copy()) {
+    /* Output --flush is holding back goes first */
+    out_flush(ctx);
+    out_drain();
+    /* In-kernel copies go through the page cache, and from a pipe pass on
+       each write as it comes, whatever --flush says */
+    if (!decoding && !no_cache &&
+        (flush.policy == FLUSH_EACH || regular_file(fd)) &&
+        zero_copy(fd, STDOUT_FILENO, filename, buffer_size, &left) == 0)
+      return 0;
+
+    if ((pipeline_depth > 1 || flush.policy != FLUSH_EACH) &&
+        out_init(ctx, output_buffer_size()) != 0) {
+      if (decoding)
+        decoder_close(decoding);
+      return alloc_error(ctx);
+    }
+    if (source_open(&src, fd, buffer_size, 0, decoding, left) != 0)
+      return alloc_error(ctx);
+
+    while ((bytes_read = source_next(&src, &data)) > 0) {
+      if (ctx->out) {
+        /* --pipeline or --flush: copy through the output buffer */
+        dcat_write(ctx, data, bytes_read);
+        out_block(ctx);
+      } else if (full_write(STDOUT_FILENO, data, bytes_read) != 0) {
+        fprintf(stderr, "%s: write error\n", PACKAGE_NAME);
+        source_close(&src);
+        return 1;
+      }
+      progress_add(filename, bytes_read);
+    }
+
+    source_close(&src);
+    if (bytes_read < 0)
+      return read_error(ctx, filename, bytes_read);
+    return 0;
+  }
+
+  /* Line-by-line processing */
+  if (out_init(ctx, output_buffer_size()) != 0) {
+    if (decoding)
+      decoder_close(decoding);
+    return alloc_error(ctx);
+  }
+  if (source_open(&src, fd, buffer_size, SOURCE_MAP, decoding, left) != 0)
+    return alloc_error(ctx);
+
+  while ((bytes_read = source_next(&src, &data)) > 0) {
+    unsigned long long start = format_start();
+    if (source_format(&src, ctx, data, bytes_read, 0, buffer_size)) {
+      bytes_read = -1;
+      break;
+    }
+    format_timed(start);
+    out_block(ctx);
+    progress_add(filename, bytes_read);
+  }
+
+  source_close(&src);
+  if (bytes_read < 0)
+    return read_error(ctx, filename, bytes_read);
+
+  return 0;
+}
+
+/* Sleep FOLLOW_INTERVAL, or until --flush=interval output falls due */
+static void follow_sleep(void) {
+  int timeout = flush_timeout();
+
+  if (timeout >= 0 && timeout < FOLLOW_INTERVAL * 1000)
+    poll(NULL, 0, timeout);
+  else
+    sleep(FOLLOW_INTERVAL);
+}
+
+/* A file --follow keeps reading, and what it waits on for more */
+struct follow {
+  int fd;
+  const char *name;
+  struct stat st; /* of the file FD is reading */
+#if defined(HAVE_SYS_INOTIFY_H) && defined(HAVE_SYS_EPOLL_H)
+  int inotify;
+  int epoll;
+  int file_watch; /* the file itself: appends, renames, deletion */
+#endif
+};
+
+#if defined(HAVE_SYS_INOTIFY_H) && defined(HAVE_SYS_EPOLL_H)
+/* Watch F's file, and the directory it is in so that a new file taking
+   its name is seen at once.  Returns 0 on success.  */
+static int follow_watch_init(struct follow *f) {
+  struct epoll_event ev;
+  const char *slash = strrchr(f->name, '/');
+  char *dir;
+
+  f->inotify = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+  if (f->inotify < 0)
+    return -1;
+  f->epoll = epoll_create1(EPOLL_CLOEXEC);
+  memset(&ev, 0, sizeof ev);
+  ev.events = EPOLLIN;
+  if (f->epoll < 0 || epoll_ctl(f->epoll, EPOLL_CTL_ADD, f->inotify, &ev))
+    goto fail;
+  f->file_watch =
+      inotify_add_watch(f->inotify, f->name,
+                        IN_MODIFY | IN_ATTRIB | IN_MOVE_SELF | IN_DELETE_SELF);
+  if (f->file_watch < 0)
+    goto fail;
+
+  if (!slash) {
+    dir = strdup(".");
+  } else {
+    dir = strdup(f->name);
+    if (dir)
+      dir[slash == f->name ? 1 : slash - f->name] = '\0';
+  }
+  /* Without the directory a replaced file is only noticed after the
+     next event on the old one */
+  if (dir)
+    inotify_add_watch(f->inotify, dir, IN_CREATE | IN_MOVED_TO);
+  free(dir);
+  return 0;
+
+fail:
+  if (f->epoll >= 0)
+    close(f->epoll);
+  close(f->inotify);
+  f->inotify = -1;
+  return -1;
+}
+
+/* Point the file watch at the file now at F's name */
+static void follow_watch_file(struct follow *f) {
+  if (f->inotify < 0)
+    return;
+  inotify_rm_watch(f->inotify, f->file_watch);
+  f->file_watch =
+      inotify_add_watch(f->inotify, f->name,
+                        IN_MODIFY | IN_ATTRIB | IN_MOVE_SELF | IN_DELETE_SELF);
+}
+
+/* Sleep until inotify reports a change, then discard the events: the
+   caller looks at the file itself to see what happened */
+static void follow_wait(struct follow *f) {
+  char events[4096]
+      __attribute__((aligned(__alignof__(struct inotify_event))));
+  struct epoll_event ev;
+
+  if (f->inotify < 0) {
+    follow_sleep();
+    return;
+  }
+  while (epoll_wait(f->epoll, &ev, 1, flush_timeout()) < 0 && errno == EINTR)
+    ;
+  while (read(f->inotify, events, sizeof events) > 0)
+    ;
+}
+
+static void follow_watch_end(struct follow *f) {
+  if (f->inotify < 0)
+    return;
+  close(f->epoll);
+  close(f->inotify);
+}
+#else
+/* No inotify: look at the file again every FOLLOW_INTERVAL seconds */
+static int follow_watch_init(struct follow *f) {
+  (void)f;
+  return -1;
+}
+
+static void follow_watch_file(struct follow *f) { (void)f; }
+
+static void follow_wait(struct follow *f) {
+  (void)f;
+  follow_sleep();
+}
+
+static void follow_watch_end(struct follow *f) { (void)f; }
+#endif
+
+/* Switch F to a new file that has taken its name, as when a log is
+   rotated, or start over on a truncated one.  The old file has been read
+   to the end already.  Returns 1 and sets *OFFSET to where to go on from
+   if either happened, 0 if F is still where it was.  */
+static int follow_reopen(struct follow *f, off_t *offset) {
+  struct stat st;
+  off_t pos = lseek(f->fd, 0, SEEK_CUR);
+  int fd;
+
+  if (stat(f->name, &st) == 0 &&
+      (st.st_ino != f->st.st_ino || st.st_dev != f->st.st_dev)) {
+    fd = open(f->name, O_RDONLY);
+    if (fd >= 0 && fstat(fd, &st) == 0) {
+      fprintf(stderr, "%s: %s: file replaced; following new file\n",
+              PACKAGE_NAME, f->name);
+      close(f->fd);
+      f->fd = fd;
+      f->st = st;
+      follow_watch_file(f);
+      *offset = 0;
+      return 1;
+    }
+    if (fd >= 0)
+      close(fd);
+  }
+  if (fstat(f->fd, &st) == 0 && st.st_size < pos) {
+    fprintf(stderr, "%s: %s: file truncated\n", PACKAGE_NAME, f->name);
+    *offset = lseek(f->fd, 0, SEEK_SET);
+    return 1;
+  }
+  return 0;
+}
+
+/* --follow: once the last file has been output up to its end, go on
+   writing what is appended to it, through the same formatter and line
+   state, until dcat is interrupted.  Waits on inotify between appends,
+   follows the name to a new file when the log is rotated and starts over
+   when it is truncated.  *FD may be replaced by the new file's.  Returns
+   1 on a read error.  */
+static int follow_file(int *fd, const char *filename,
+                       struct dcat_ctx *ctx) {
+  struct follow f;
+  size_t buffer_size = input_buffer_size(*fd) & ~(size_t)15;
+  char *buffer;
+  off_t offset;
+  ssize_t n;
+
+  f.fd = *fd;
+  f.name = filename;
+  if (fstat(f.fd, &f.st) != 0 || !S_ISREG(f.st.st_mode))
+    return 0; /* Pipes and terminals have been read to their end */
+  if (decompress_mode) {
+    unsigned char magic[4];
+    ssize_t len = pread(f.fd, magic, sizeof magic, 0);
+
+    if (len > 0 && compressed_format(magic, len) != DEC_NONE)
+      return 0; /* Appends to compressed data cannot be decoded alone */
+  }
+  buffer = buffer_get(buffer_size);
+  if (!buffer || (flush.policy != FLUSH_EACH &&
+                  out_init(ctx, output_buffer_size()) != 0)) {
+    buffer_put(buffer);
+    fprintf(stderr, "%s: memory allocation failed\n", PACKAGE_NAME);
+    return 1;
+  }
+  /* Watch before looking for more, so no append can fall in between */
+  follow_watch_init(&f);
+  offset = lseek(f.fd, 0, SEEK_CUR);
+
+  for (;;) {
+    while ((n = safe_read(f.fd, buffer, buffer_size)) > 0) {
+      if (hex_dump_mode) {
+        hex_dump_block(ctx, (const unsigned char *)buffer, n, offset,
+                       buffer_size);
+      } else if (ctx->out) {
+        if (plain_copy())
+          dcat_write(ctx, buffer, n);
+        else
+          format_block(ctx, buffer, n, buffer_size);
+      } else if (full_write(STDOUT_FILENO, buffer, n) != 0) {
+        fprintf(stderr, "%s: write error\n", PACKAGE_NAME);
+        exit(1);
+      }
+      offset += n;
+      /* Whatever was appended goes out now, unless --flush says
+         otherwise */
+      out_block(ctx);
+    }
+    if (n < 0) {
+      fprintf(stderr, "%s: %s: %s\n", PACKAGE_NAME, filename,
+              strerror(errno));
+      break;
+    }
+    if (!follow_reopen(&f, &offset)) {
+      follow_wait(&f);
+      flush_due();
+    }
+  }
+
+  follow_watch_end(&f);
+  buffer_put(buffer);
+  *fd = f.fd;
+  return 1;
+}
+
+/* --stats figures for one input file */
+struct file_stats {
+  const char *name;
+  unsigned long long counts[ST_COUNT];
+};
+static struct file_stats *file_stats;
+static size_t file_stats_count;
+static unsigned long long stats_mark[ST_COUNT]; /* totals at file start */
+static unsigned long long stats_mark_ns;
+
+#ifdef HAVE_LINUX_PERF_EVENT_H
+/* Hardware counters of the main thread for --stats, or -1 */
+static int perf_fds[2] = {-1, -1};
+
+static void perf_open(void) {
+  static const unsigned long long events[2] = {PERF_COUNT_HW_CPU_CYCLES,
+                                               PERF_COUNT_HW_INSTRUCTIONS};
+
+  for (int i = 0; i < 2; i++) {
+    struct perf_event_attr attr;
+
+    memset(&attr, 0, sizeof attr);
+    attr.type = PERF_TYPE_HARDWARE;
+    attr.size = sizeof attr;
+    attr.config = events[i];
+    attr.exclude_hv = 1;
+    perf_fds[i] = syscall(__NR_perf_event_open, &attr, 0, -1, -1, 0);
+    if (perf_fds[i] < 0) {
+      /* perf_event_paranoid may only allow counting user space */
+      attr.exclude_kernel = 1;
+      perf_fds[i] = syscall(__NR_perf_event_open, &attr, 0, -1, -1, 0);
+    }
+  }
+}
+
+static int perf_read(int i, unsigned long long *value) {
+  return perf_fds[i] >= 0 &&
+         read(perf_fds[i], value, sizeof *value) == sizeof *value;
+}
+#endif
+
+/* Copy the running totals; other threads may still be adding to them */
+static void stats_snapshot(unsigned long long *counts) {
+  for (int i = 0; i < ST_COUNT; i++)
+    counts[i] = __atomic_load_n(&stats[i], __ATOMIC_RELAXED);
+#ifdef HAVE_LINUX_PERF_EVENT_H
+  if (!perf_read(0, &counts[ST_CYCLES]) ||
+      !perf_read(1, &counts[ST_INSTRUCTIONS]))
+    counts[ST_CYCLES] = counts[ST_INSTRUCTIONS] = 0;
+#endif
+}
+
+/* Start counting a new file */
+static void stats_file_begin(void) {
+  stats_snapshot(stats_mark);
+  stats_mark_ns = stats_clock();
+}
+
+/* Record what happened since stats_file_begin() as NAME's figures */
+static void stats_file_end(const char *name) {
+  struct file_stats *fs;
+  unsigned long long now[ST_COUNT];
+
+  stats_snapshot(now);
+  now[ST_WALL_NS] = stats_clock() - stats_mark_ns;
+  fs = realloc(file_stats, (file_stats_count + 1) * sizeof *file_stats);
+  if (!fs)
+    return;
+  file_stats = fs;
+  fs = &file_stats[file_stats_count++];
+  fs->name = name;
+  for (int i = 0; i < ST_COUNT; i++)
+    fs->counts[i] = i == ST_WALL_NS ? now[i] : now[i] - stats_mark[i];
+  stats_file_begin();
+}
+
+static void print_stats_text(const char *name,
+                             const unsigned long long *c) {
+  fprintf(stderr,
+          "%s: %s: %llu bytes in, %llu bytes out, %llu reads, %llu writes "
+          "(%llu short); read %.3fs, format %.3fs, write %.3fs, wall %.3fs",
+          PACKAGE_NAME, name, c[ST_BYTES_IN], c[ST_BYTES_OUT], c[ST_READS],
+          c[ST_WRITES], c[ST_SHORT_WRITES], c[ST_READ_NS] / 1e9,
+          c[ST_FORMAT_NS] / 1e9, c[ST_WRITE_NS] / 1e9, c[ST_WALL_NS] / 1e9);
+  if (c[ST_CYCLES] > 0 && c[ST_BYTES_IN] > 0)
+    fprintf(stderr, "; %.2f cycles/byte, %.2f instructions/byte",
+            (double)c[ST_CYCLES] / c[ST_BYTES_IN],
+            (double)c[ST_INSTRUCTIONS] / c[ST_BYTES_IN]);
+  fputc('\n', stderr);
+}
+
+static void print_stats_json(const char *name, const unsigned long long *c) {
+  static const char *const keys[ST_COUNT] = {
+      "bytes_in", "bytes_out", "reads",   "writes",
+      "short_writes", "read_ns", "format_ns", "write_ns",
+      "wall_ns", "cycles", "instructions"};
+
+  if (name) {
+    fputs("{\"name\": \"", stderr);
+    for (const unsigned char *p = (const unsigned char *)name; *p; p++) {
+      if (*p == '"' || *p == '\\')
+        fprintf(stderr, "\\%c", *p);
+      else if (*p < 0x20)
+        fprintf(stderr, "\\u%04x", *p);
+      else
+        fputc(*p, stderr);
+    }
+    fputs("\", ", stderr);
+  } else {
+    fputc('{', stderr);
+  }
+  for (int i = 0; i < ST_COUNT; i++)
+    fprintf(stderr, "%s\"%s\": %llu", i ? ", " : "", keys[i], c[i]);
+  fputc('}', stderr);
+}
 
-/* Buffer size for optimal I/O */
-#define DEFAULT_BUFFER_SIZE 4194304 /* 4MB buffer */
+/* Print the --stats summary: every file, then the totals */
+static void print_stats(unsigned long long wall_ns) {
+  unsigned long long total[ST_COUNT];
 
-/* Hex dump a buffer */
-static void hex_dump(const unsigned char *buffer, size_t length,
-                     unsigned long offset) {
-  char ascii[17];
-  size_t i, j;
-
-  for (i = 0; i < length; i += 16) {
-    /* Print offset */
-    printf("%08lx: ", offset + i);
-
-    /* Print hex values */
-    for (j = 0; j < 16; j++) {
-      if (i + j < length) {
-        printf("%02x ", buffer[i + j]);
-        ascii[j] =
-            (buffer[i + j] >= 32 && buffer[i + j] < 127) ? buffer[i + j] : '.';
-      } else {
-        printf("   ");
-        ascii[j] = ' ';
-      }
+  stats_snapshot(total);
+  total[ST_WALL_NS] = wall_ns;
+  if (stats_mode == STATS_TEXT) {
+    fprintf(stderr, "%s: scan kernels: %s\n", PACKAGE_NAME,
+            dcat_kernels());
+    for (size_t i = 0; i < file_stats_count; i++)
+      print_stats_text(file_stats[i].name, file_stats[i].counts);
+    print_stats_text("total", total);
+    return;
+  }
 
-      /* Add space between 8-byte groups */
-      if (j == 7)
-        printf(" ");
-    }
+  fprintf(stderr, "{\"kernels\": \"%s\", \"files\": [",
+          dcat_kernels());
+  for (size_t i = 0; i < file_stats_count; i++) {
+    fputs(i ? ", " : "", stderr);
+    print_stats_json(file_stats[i].name, file_stats[i].counts);
+  }
+  fputs("], \"total\": ", stderr);
+  print_stats_json(NULL, total);
+  fputs("}\n", stderr);
+}
+
+#if defined(HAVE_IO_URING) && defined(HAVE_MMAP)
+/* The io_uring instance for --io=uring, driven with raw system calls */
+static struct {
+  int fd;
+  unsigned *sq_tail;
+  unsigned *sq_mask;
+  unsigned *sq_array;
+  unsigned *cq_head;
+  unsigned *cq_tail;
+  unsigned *cq_mask;
+  struct io_uring_sqe *sqes;
+  struct io_uring_cqe *cqes;
+  unsigned entries;
+  unsigned queued;   /* SQEs not yet handed to the kernel */
+  unsigned inflight; /* SQEs handed over and not yet completed */
+} ring;
 
-    /* Print ASCII representation */
-    ascii[16] = '\0';
-    printf(" %s\n", ascii);
+/* Completion tag of close requests, which no file waits for */
+#define URING_CLOSE (~(__u64)0)
+
+/* Set up a ring of ENTRIES, returning -1 when the kernel has no io_uring
+   or one older than 5.6, which added the open, read and close requests */
+static int uring_setup(unsigned entries) {
+  struct io_uring_params params;
+  size_t sq_size, cq_size;
+  char *sq, *cq;
+  void *sqes;
+
+  memset(&params, 0, sizeof params);
+  ring.fd = syscall(__NR_io_uring_setup, entries, &params);
+  if (ring.fd < 0)
+    return -1;
+  if (!(params.features & IORING_FEAT_RW_CUR_POS))
+    goto fail;
+
+  sq_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+  cq_size = params.cq_off.cqes +
+            params.cq_entries * sizeof(struct io_uring_cqe);
+  if (params.features & IORING_FEAT_SINGLE_MMAP) {
+    if (cq_size > sq_size)
+      sq_size = cq_size;
+    cq_size = sq_size;
+  }
+  sq = mmap(NULL, sq_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+            ring.fd, IORING_OFF_SQ_RING);
+  if (sq == MAP_FAILED)
+    goto fail;
+  cq = sq;
+  if (!(params.features & IORING_FEAT_SINGLE_MMAP)) {
+    cq = mmap(NULL, cq_size, PROT_READ | PROT_WRITE,
+              MAP_SHARED | MAP_POPULATE, ring.fd, IORING_OFF_CQ_RING);
+    if (cq == MAP_FAILED)
+      goto fail;
   }
+  sqes = mmap(NULL, params.sq_entries * sizeof(struct io_uring_sqe),
+              PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring.fd,
+              IORING_OFF_SQES);
+  if (sqes == MAP_FAILED)
+    goto fail;
+
+  /* The maps stay until exit, when the kernel tears the ring down */
+  ring.sq_tail = (unsigned *)(sq + params.sq_off.tail);
+  ring.sq_mask = (unsigned *)(sq + params.sq_off.ring_mask);
+  ring.sq_array = (unsigned *)(sq + params.sq_off.array);
+  ring.cq_head = (unsigned *)(cq + params.cq_off.head);
+  ring.cq_tail = (unsigned *)(cq + params.cq_off.tail);
+  ring.cq_mask = (unsigned *)(cq + params.cq_off.ring_mask);
+  ring.sqes = sqes;
+  ring.cqes = (struct io_uring_cqe *)(cq + params.cq_off.cqes);
+  ring.entries = params.sq_entries;
+  return 0;
+
+fail:
+  close(ring.fd);
+  return -1;
 }
-#define get_buffer_size()                                                      \
-  (custom_buffer_size > 0 ? custom_buffer_size : DEFAULT_BUFFER_SIZE)
 
-static void usage(int status) {
-  if (status != 0) {
-    fprintf(stderr, "Try '%s --help' for more information.\n", PACKAGE_NAME);
-  } else {
-    printf("Usage: %s [OPTION]... [FILE]...\n", PACKAGE_NAME);
-    printf("Concatenate FILE(s) to standard output.\n\n");
-    printf("With no FILE, or when FILE is -, read standard input.\n\n");
-    printf("  -A, --show-all           equivalent to -vET\n");
-    printf("  -b, --number-nonblank    number nonempty output lines, overrides "
-           "-n\n");
-    printf("  -e                       equivalent to -vE\n");
-    printf("  -E, --show-ends          display $ at end of each line\n");
-    printf("  -n, --number             number all output lines\n");
-    printf("  -s, --squeeze-blank      suppress repeated empty output lines\n");
-    printf("  -t                       equivalent to -vT\n");
-    printf("  -T, --show-tabs          display TAB characters as ^I\n");
-    printf("  -v, --show-nonprinting   use ^ and M- notation, except for LFD "
-           "and TAB\n");
-    printf(
-        "      --buffer-size=SIZE   use SIZE-byte buffer (default 262144)\n");
-    printf("      --progress           show progress for large files\n");
-    printf("      --hex-dump           show hex dump of binary data\n");
-    printf("      --help               display this help and exit\n");
-    printf(
-        "      --version            output version information and exit\n\n");
-    printf("Examples:\n");
-    printf("  %s f - g  Output f's contents, then standard input, then g's "
-           "contents.\n",
-           PACKAGE_NAME);
-    printf("  %s        Copy standard input to standard output.\n\n",
-           PACKAGE_NAME);
+/* Queue a request; it goes to the kernel with the next uring_enter() */
+static void uring_queue(int opcode, int fd, void *addr, unsigned len,
+                        __u64 user_data) {
+  unsigned tail = *ring.sq_tail;
+  unsigned index = tail & *ring.sq_mask;
+  struct io_uring_sqe *sqe = &ring.sqes[index];
+
+  memset(sqe, 0, sizeof *sqe);
+  sqe->opcode = opcode;
+  sqe->fd = fd;
+  sqe->addr = (unsigned long)addr;
+  sqe->len = len;
+  sqe->user_data = user_data;
+  if (opcode == IORING_OP_OPENAT)
+    sqe->open_flags = O_RDONLY;
+  else if (opcode == IORING_OP_READ)
+    sqe->off = (__u64)-1; /* read from the file position, like read() */
+  ring.sq_array[index] = index;
+  __atomic_store_n(ring.sq_tail, tail + 1, __ATOMIC_RELEASE);
+  ring.queued++;
+}
+
+/* Hand queued requests to the kernel, waiting for one to complete when
+   WAIT is set.  Returns -1 with errno set if the ring stops working.  */
+static int uring_enter(int wait) {
+  while (ring.queued > 0 || wait) {
+    int n = syscall(__NR_io_uring_enter, ring.fd, ring.queued, wait ? 1 : 0,
+                    wait ? IORING_ENTER_GETEVENTS : 0, NULL, 0);
+    if (n < 0) {
+      if (errno == EINTR)
+        continue;
+      return -1;
+    }
+    ring.queued -= n;
+    ring.inflight += n;
+    wait = 0;
   }
-  exit(status);
+  return 0;
 }
 
-static void version(void) {
-  printf("%s %s\n", PACKAGE_NAME, VERSION);
-  printf("Copyright (C) 2025 Juan Manuel Rodriguez.\n");
-  printf("License GPLv3+: GNU GPL version 3 or later "
-         "<https://gnu.org/licenses/gpl.html>.\n");
-  printf(
-      "This is free software: you are free to change and redistribute it.\n");
-  printf("There is NO WARRANTY, to the extent permitted by law.\n\n");
-  printf("Written by %s.\n", AUTHOR);
-  exit(0);
+/* A file named on the command line, as --io=uring works through it */
+struct uring_file {
+  const char *name;
+  int fd;     /* -1 while the open is in flight */
+  int busy;   /* a request for this file is in flight */
+  int eof;    /* no more data; set on errors too */
+  int error;  /* errno of a failed open or read */
+  char *buffer;
+  size_t filled;
+  size_t total; /* bytes already passed on */
+};
+
+/* Pass a block of FILE's data on to whatever the options ask for */
+static void uring_consume(struct uring_file *file, struct dcat_ctx *ctx,
+                          size_t buffer_size) {
+  unsigned long long start = format_start();
+
+  if (hex_dump_mode)
+    hex_dump_block(ctx, (const unsigned char *)file->buffer, file->filled,
+                   file->total, buffer_size);
+  else if (plain_copy())
+    dcat_write(ctx, file->buffer, file->filled);
+  else
+    format_block(ctx, file->buffer, file->filled, buffer_size);
+  format_timed(start);
+  progress_add(file->name, file->filled);
+  file->total += file->filled;
+  file->filled = 0;
 }
 
-/* Process a buffer line by line, applying formatting options */
-static void process_buffer(const char *buffer, size_t size,
-                           unsigned long *line_num, int *last_char_was_newline,
-                           int *consecutive_blank_lines) {
-  const char *ptr = buffer;
-  const char *end = buffer + size;
+/* Read the COUNT files in FILES through io_uring and output them in order.
+   Up to URING_FILES files are opened and read ahead at once, and output
+   from many small files is gathered into one write.  Standard input is
+   only read once it is the file being output.  Returns the exit status, or
+   -1 before doing anything if the kernel cannot do this.  */
+static int uring_files(char **files, int count, struct dcat_ctx *ctx) {
+  static struct uring_file slots[URING_FILES];
+  size_t buffer_size = output_buffer_size();
+  size_t block = buffer_size < URING_BLOCK_SIZE ? buffer_size
+                                                : URING_BLOCK_SIZE;
+  int head = 0, next = 0;
+  int ret = 0;
 
-  while (ptr < end) {
-    const char *line_start = ptr;
-    const char *line_end = memchr(ptr, '\n', end - ptr);
+  /* Keep hex rows whole: only the last block of a file may come up short */
+  block &= ~(size_t)15;
 
-    if (line_end == NULL) {
-      line_end = end;
+  if (uring_setup(URING_FILES * 2) != 0)
+    return -1;
+  if (out_init(ctx, buffer_size) != 0) {
+    fprintf(stderr, "%s: memory allocation failed\n", PACKAGE_NAME);
+    return 1;
+  }
+  for (int i = 0; i < URING_FILES; i++) {
+    if (!slots[i].buffer && !(slots[i].buffer = buffer_get(block))) {
+      fprintf(stderr, "%s: memory allocation failed\n", PACKAGE_NAME);
+      return 1;
     }
+  }
 
-    size_t line_length = line_end - line_start;
+  while (head < count) {
+    struct uring_file *file;
+    unsigned cqe_head, cqe_tail;
+    unsigned long long start;
 
-    if (line_length == 0) {
-      (*consecutive_blank_lines)++;
-    } else {
-      *consecutive_blank_lines = 0;
+    /* Start opening the files coming up */
+    while (next < count && next - head < URING_FILES &&
+           ring.inflight + ring.queued < ring.entries) {
+      file = &slots[next % URING_FILES];
+      file->name = files[next];
+      file->busy = file->eof = file->error = 0;
+      file->filled = file->total = 0;
+      if (strcmp(file->name, "-") == 0) {
+        file->fd = STDIN_FILENO;
+      } else {
+        file->fd = -1;
+        file->busy = 1;
+        uring_queue(IORING_OP_OPENAT, AT_FDCWD, (void *)file->name, 0,
+                    next % URING_FILES);
+      }
+      next++;
     }
 
-    if (squeeze_blank && *consecutive_blank_lines > 1) {
-      ptr = line_end + 1;
-      if (line_end < end) {
-        *last_char_was_newline = 1;
+    /* Output the head file as far as its data has arrived */
+    file = &slots[head % URING_FILES];
+    if (!file->busy) {
+      if (file->filled > 0 &&
+          (file->eof || file->filled == block || !hex_dump_mode))
+        uring_consume(file, ctx, buffer_size);
+      /* Output is gathered until the buffer fills, unless --flush says
+         otherwise */
+      if (flush.policy != FLUSH_EACH)
+        out_block(ctx);
+      if (file->eof) {
+        if (file->error) {
+          /* Keep errors in place among the output */
+          out_flush(ctx);
+          out_drain();
+          fprintf(stderr, "%s: %s: %s\n", PACKAGE_NAME, file->name,
+                  strerror(file->error));
+          ret = 1;
+        }
+        if (file->fd > STDIN_FILENO) {
+          uring_queue(IORING_OP_CLOSE, file->fd, NULL, 0, URING_CLOSE);
+        }
+        if (stats_mode && file->fd != INT_MIN)
+          stats_file_end(file->name);
+        head++;
+        continue;
       }
-      continue;
     }
 
-    /* Number lines */
-    if (number_lines) {
-      if (*last_char_was_newline) {
-        fprintf(stdout, "%6lu\t", ++(*line_num));
-      }
-    } else if (number_nonblank && line_length > 0) {
-      if (*last_char_was_newline) {
-        fprintf(stdout, "%6lu\t", ++(*line_num));
-      }
+    /* Read ahead into every buffer with room, the head file's first */
+    for (int i = head; i < next; i++) {
+      file = &slots[i % URING_FILES];
+      if (file->busy || file->eof || file->filled == block ||
+          (file->fd == STDIN_FILENO && i != head) ||
+          ring.inflight + ring.queued >= ring.entries)
+        continue;
+      file->busy = 1;
+      uring_queue(IORING_OP_READ, file->fd, file->buffer + file->filled,
+                  block - file->filled, i % URING_FILES);
+    }
+
+    start = stats_mode ? stats_clock() : 0;
+    if (uring_enter(1) != 0) {
+      int err = errno;
+      out_flush(ctx);
+      out_drain();
+      fprintf(stderr, "%s: %s\n", PACKAGE_NAME, strerror(err));
+      return 1;
     }
+    if (stats_mode)
+      stats_add(ST_READ_NS, stats_clock() - start);
 
-    /* Process and print the line content */
-    for (size_t i = 0; i < line_length; ++i) {
-      unsigned char c = line_start[i];
-      if (show_tabs && c == '\t') {
-        printf("^I");
-      } else if (show_nonprinting && (c < 32 || c > 126) && c != '\n' &&
-                 c != '\t') {
-        if (c < 32) {
-          printf("^%c", c + 64);
-        } else if (c == 127) {
-          printf("^?");
+    cqe_head = *ring.cq_head;
+    cqe_tail = __atomic_load_n(ring.cq_tail, __ATOMIC_ACQUIRE);
+    for (; cqe_head != cqe_tail; cqe_head++) {
+      struct io_uring_cqe *cqe = &ring.cqes[cqe_head & *ring.cq_mask];
+
+      ring.inflight--;
+      if (cqe->user_data == URING_CLOSE)
+        continue;
+      file = &slots[cqe->user_data];
+      file->busy = 0;
+      if (file->fd < 0) {
+        /* Open finished */
+        if (cqe->res >= 0) {
+          file->fd = cqe->res;
         } else {
-          printf("M-^%c", c - 128 + 64);
+          file->fd = INT_MIN;
+          file->error = -cqe->res;
+          file->eof = 1;
         }
-      } else {
-        putchar(c);
+      } else if (cqe->res > 0) {
+        file->filled += cqe->res;
+        if (stats_mode) {
+          stats_add(ST_READS, 1);
+          stats_add(ST_BYTES_IN, cqe->res);
+        }
+      } else if (cqe->res == 0) {
+        file->eof = 1;
+      } else if (cqe->res != -EINTR) {
+        file->error = -cqe->res;
+        file->eof = 1;
       }
     }
+    __atomic_store_n(ring.cq_head, cqe_head, __ATOMIC_RELEASE);
+  }
 
-    if (line_end < end) {
-      if (show_ends) {
-        putchar('$');
-      }
-      putchar('\n');
-      *last_char_was_newline = 1;
-      ptr = line_end + 1;
-    } else {
-      *last_char_was_newline = 0;
-      ptr = line_end;
-    }
+  /* Let the last closes go; they have nothing left to report */
+  uring_enter(0);
+  return ret;
+}
+#else
+static int uring_files(char **files, int count, struct dcat_ctx *ctx) {
+  (void)files;
+  (void)count;
+  (void)ctx;
+  return -1;
+}
+#endif
+
+/* A file --prefetch opened before its turn */
+struct prefetched_file {
+  int fd;    /* -1 if not opened early */
+  int error; /* errno of a failed early open */
+  int done;  /* --jobs: a job thread is finished with it */
+};
+static struct prefetched_file prefetched[MAX_PREFETCH + 1];
+
+/* Open FILENAME ahead of its turn and have the kernel start reading its
+   first block in the background.  Only regular files are opened early:
+   opening a FIFO could block, and standard input must wait its turn.  */
+static void prefetch_file(const char *filename, struct prefetched_file *p) {
+  struct stat st;
+
+  p->fd = -1;
+  p->error = 0;
+  if (strcmp(filename, "-") == 0 || stat(filename, &st) != 0 ||
+      !S_ISREG(st.st_mode))
+    return;
+
+  p->fd = open(filename, O_RDONLY);
+  if (p->fd < 0) {
+    p->error = errno;
+    return;
   }
+  /* Reading ahead would fill the page cache, or for --lines read from
+     the wrong place */
+  if (no_cache || lines_first > 0)
+    return;
+#if defined(HAVE_POSIX_FADVISE)
+  posix_fadvise(p->fd, range_offset, input_buffer_size(p->fd),
+                POSIX_FADV_WILLNEED);
+#elif defined(HAVE_READAHEAD)
+  readahead(p->fd, range_offset, input_buffer_size(p->fd));
+#endif
 }
 
-/* Process a file or stdin */
-static int process_file(FILE *fp, const char *filename,
-                        unsigned long *line_num) {
-  size_t buffer_size = get_buffer_size();
+#ifdef HAVE_PTHREAD
+/* Threads --jobs starts to open and read the files coming up, so that on
+   a file system where each open and read waits on the network they wait
+   side by side.  Each thread reads a file's first block into a buffer of
+   its own; the data then comes from the page cache when the file's turn
+   comes, so output, line numbers and errors follow argv as always.  */
+static struct {
+  pthread_mutex_t lock;
+  pthread_cond_t opened; /* a file has been opened and read */
+  pthread_cond_t moved;  /* the main thread moved on to another file */
+  char **files;
+  int count;
+  int next;    /* next file for a job thread to take */
+  int current; /* file the main thread is on */
+  int stop;
+  int threads;
+  size_t read_size; /* how much of each file to read ahead */
+  pthread_t thread[MAX_JOBS];
+} jobs;
 
-  /* Hex dump mode - takes precedence over all other options */
-  if (hex_dump_mode) {
-    unsigned char *buffer = malloc(buffer_size);
-    size_t bytes_read;
-    unsigned long offset = 0;
+static void *job_thread(void *arg) {
+  char *buffer = arg;
 
-    if (!buffer) {
-      fprintf(stderr, "%s: memory allocation failed\n", PACKAGE_NAME);
-      return 1;
-    }
+  pthread_mutex_lock(&jobs.lock);
+  while (!jobs.stop && jobs.next < jobs.count) {
+    int k = jobs.next;
+    struct prefetched_file *p = &prefetched[k % (MAX_PREFETCH + 1)];
 
-    while ((bytes_read = fread(buffer, 1, buffer_size, fp)) > 0) {
-      hex_dump(buffer, bytes_read, offset);
-      offset += bytes_read;
+    /* Stay within --jobs files of the main thread, so the slots it has
+       yet to take are never reused */
+    if (k > jobs.current + job_count) {
+      pthread_cond_wait(&jobs.moved, &jobs.lock);
+      continue;
     }
+    jobs.next++;
+    pthread_mutex_unlock(&jobs.lock);
 
-    free(buffer);
-    if (ferror(fp)) {
-      fprintf(stderr, "%s: %s: %s\n", PACKAGE_NAME, filename, strerror(errno));
-      return 1;
-    }
-    return 0;
+    prefetch_file(jobs.files[k], p);
+    /* A failed read is left for the main thread to meet, in its place */
+    if (p->fd >= 0 && !no_cache && lines_first == 0)
+      (void)!pread(p->fd, buffer, jobs.read_size, (off_t)range_offset);
+
+    pthread_mutex_lock(&jobs.lock);
+    p->done = 1;
+    pthread_cond_broadcast(&jobs.opened);
   }
+  pthread_mutex_unlock(&jobs.lock);
+  buffer_free(buffer, jobs.read_size);
+  return NULL;
+}
 
-  /* No options enabled */
-  if (!show_all && !number_nonblank && !show_ends && !number_lines &&
-      !squeeze_blank && !show_tabs && !show_nonprinting) {
-    char *buffer = malloc(buffer_size);
-    char *stdout_buffer = malloc(buffer_size);
-    size_t bytes_read;
-    size_t total_bytes = 0;
-
-    if (!buffer || !stdout_buffer) {
-      fprintf(stderr, "%s: memory allocation failed\n", PACKAGE_NAME);
-      free(buffer);
-      free(stdout_buffer);
-      return 1;
-    }
+/* Start the --jobs threads on FILES from FIRST up to COUNT.  Returns 0 if
+   at least one started.  */
+static int jobs_start(char **files, int first, int count) {
+  jobs.files = files;
+  jobs.count = count;
+  jobs.next = first;
+  jobs.current = first;
+  jobs.read_size = output_buffer_size();
+  pthread_mutex_init(&jobs.lock, NULL);
+  pthread_cond_init(&jobs.opened, NULL);
+  pthread_cond_init(&jobs.moved, NULL);
+  for (int i = first; i < count && i <= first + job_count; i++)
+    prefetched[i % (MAX_PREFETCH + 1)].done = 0;
+
+  for (int i = 0; i < job_count; i++) {
+    char *buffer = buffer_alloc(jobs.read_size);
 
-    if (setvbuf(stdout, NULL, _IONBF, 0) != 0) {
-      /* Fall back to default buffering if setvbuf fails */
-      /* Keep stdout_buffer allocated but unused */
+    if (!buffer)
+      break;
+    if (pthread_create(&jobs.thread[jobs.threads], NULL, job_thread,
+                       buffer) != 0) {
+      buffer_free(buffer, jobs.read_size);
+      break;
     }
+    jobs.threads++;
+  }
+  return jobs.threads > 0 ? 0 : -1;
+}
 
-    while ((bytes_read = fread(buffer, 1, buffer_size, fp)) > 0) {
-      if (fwrite(buffer, 1, bytes_read, stdout) != bytes_read) {
-        fprintf(stderr, "%s: write error\n", PACKAGE_NAME);
-        free(buffer);
-        free(stdout_buffer);
-        return 1;
-      }
-      total_bytes += bytes_read;
+/* Wait for the job threads to be done with file K, the main thread's next
+   one, and let them go on to the file --jobs past it */
+static struct prefetched_file *jobs_take(int k) {
+  struct prefetched_file *p = &prefetched[k % (MAX_PREFETCH + 1)];
+
+  pthread_mutex_lock(&jobs.lock);
+  jobs.current = k;
+  pthread_cond_broadcast(&jobs.moved);
+  while (!p->done)
+    pthread_cond_wait(&jobs.opened, &jobs.lock);
+  /* Ready the slot for the file that will use it next */
+  p->done = 0;
+  pthread_mutex_unlock(&jobs.lock);
+  return p;
+}
+
+static void jobs_stop(void) {
+  pthread_mutex_lock(&jobs.lock);
+  jobs.stop = 1;
+  pthread_cond_broadcast(&jobs.moved);
+  pthread_mutex_unlock(&jobs.lock);
+  for (int i = 0; i < jobs.threads; i++)
+    pthread_join(jobs.thread[i], NULL);
+  pthread_cond_destroy(&jobs.opened);
+  pthread_cond_destroy(&jobs.moved);
+  pthread_mutex_destroy(&jobs.lock);
+}
+#else
+static int jobs_start(char **files, int first, int count) {
+  (void)files;
+  (void)first;
+  (void)count;
+  return -1;
+}
+
+static struct prefetched_file *jobs_take(int k) {
+  (void)k;
+  return NULL;
+}
 
-      /* Show progress for large files */
-      if (show_progress && total_bytes > 10 * 1024 * 1024) { /* Every 10MB */
-        fprintf(stderr, "\r%s: %lu MB processed", filename,
-                total_bytes / (1024 * 1024));
-        fflush(stderr);
+static void jobs_stop(void) {}
+#endif
+
+/* A place in a file where a line starts, and the lines before it */
+struct line_mark {
+  unsigned long long offset;
+  struct dcat_lines count;
+};
+
+/* Store V in the 8 bytes at P, least significant first */
+static void put64(unsigned char *p, unsigned long long v) {
+  for (int i = 0; i < 8; i++)
+    p[i] = (unsigned char)(v >> (8 * i));
+}
+
+static unsigned long long get64(const unsigned char *p) {
+  unsigned long long v = 0;
+
+  for (int i = 7; i >= 0; i--)
+    v = v << 8 | p[i];
+  return v;
+}
+
+/* ST's modification time in nanoseconds, as finely as the system keeps
+   it */
+static unsigned long long mtime_ns(const struct stat *st) {
+#ifdef HAVE_STRUCT_STAT_ST_MTIM
+  return (unsigned long long)st->st_mtim.tv_sec * 1000000000ULL +
+         st->st_mtim.tv_nsec;
+#else
+  return (unsigned long long)st->st_mtime * 1000000000ULL;
+#endif
+}
+
+/* The name of FILENAME's index, to be freed; NULL if out of memory */
+static char *index_name(const char *filename) {
+  size_t len = strlen(filename);
+  char *name = malloc(len + sizeof INDEX_SUFFIX);
+
+  if (name) {
+    memcpy(name, filename, len);
+    memcpy(name + len, INDEX_SUFFIX, sizeof INDEX_SUFFIX);
+  }
+  return name;
+}
+
+/* --build-index: count FILENAME's lines and write where every
+   index_interval'th one ends to its index, through a temporary file
+   renamed into place.  Returns 0, or 1 after reporting an error.  */
+static int build_index(const char *filename) {
+  unsigned char header[INDEX_HEADER_SIZE];
+  unsigned char *table = NULL;
+  size_t entries = 0;
+  size_t table_size = 0;
+  struct dcat_lines count = {0, 0, 1};
+  unsigned long long offset = 0;
+  unsigned long long next = index_interval;
+  char *buffer = NULL;
+  char *name = NULL;
+  char *temp = NULL;
+  const char *failed = filename; /* the file an error is about */
+  struct stat st, now;
+  ssize_t n;
+  mode_t mask;
+  int fd, out, ok;
+  int ret = 1;
+
+  fd = open(filename, O_RDONLY);
+  if (fd < 0 || fstat(fd, &st) != 0)
+    goto fail;
+  if (!S_ISREG(st.st_mode)) {
+    errno = S_ISDIR(st.st_mode) ? EISDIR : ESPIPE;
+    goto fail;
+  }
+  buffer = buffer_alloc(SCAN_BLOCK_SIZE);
+  name = index_name(filename);
+  temp = name ? malloc(strlen(name) + sizeof ".XXXXXX") : NULL;
+  if (!buffer || !temp) {
+    errno = ENOMEM;
+    goto fail;
+  }
+
+  while ((n = safe_read(fd, buffer, SCAN_BLOCK_SIZE)) > 0) {
+    for (size_t used = 0; used < (size_t)n;) {
+      used += dcat_count_lines(&count, buffer + used, n - used, next);
+      if (count.lines < next)
+        break;
+      if (table_size < (entries + 1) * INDEX_ENTRY_SIZE) {
+        size_t size = table_size ? table_size * 2 : 4096 * INDEX_ENTRY_SIZE;
+        unsigned char *grown = realloc(table, size);
+        if (!grown) {
+          errno = ENOMEM;
+          goto fail;
+        }
+        table = grown;
+        table_size = size;
       }
+      put64(table + entries * INDEX_ENTRY_SIZE, offset + used);
+      put64(table + entries * INDEX_ENTRY_SIZE + 8, count.empty);
+      entries++;
+      next += index_interval;
     }
+    offset += n;
+  }
+  if (n < 0)
+    goto fail;
+  /* An index of a file that changed underneath would mislead --lines */
+  if (fstat(fd, &now) != 0 || now.st_size != st.st_size ||
+      mtime_ns(&now) != mtime_ns(&st) ||
+      offset != (unsigned long long)st.st_size) {
+    fprintf(stderr, "%s: %s: file changed while being indexed\n",
+            PACKAGE_NAME, filename);
+    failed = NULL;
+    goto fail;
+  }
 
-    if (show_progress && total_bytes > 10 * 1024 * 1024) {
-      fprintf(stderr, "\r%s: %lu MB processed - done\n", filename,
-              total_bytes / (1024 * 1024));
-    }
+  memcpy(header, INDEX_MAGIC, 8);
+  put64(header + 8, index_interval);
+  put64(header + 16, st.st_size);
+  put64(header + 24, mtime_ns(&st));
+  put64(header + 32, count.lines);
+  put64(header + 40, count.empty);
+  put64(header + 48, entries);
 
-    free(buffer);
-    free(stdout_buffer);
-    if (ferror(fp)) {
-      fprintf(stderr, "%s: %s: %s\n", PACKAGE_NAME, filename, strerror(errno));
-      return 1;
-    }
-    return 0;
+  failed = name;
+  sprintf(temp, "%s.XXXXXX", name);
+  out = mkstemp(temp);
+  if (out < 0)
+    goto fail;
+  mask = umask(0);
+  umask(mask);
+  ok = fchmod(out, 0666 & ~mask) == 0 &&
+       full_write(out, header, sizeof header) == 0 &&
+       (entries == 0 ||
+        full_write(out, table, entries * INDEX_ENTRY_SIZE) == 0);
+  if (close(out) != 0)
+    ok = 0;
+  if (!ok || rename(temp, name) != 0) {
+    int error = errno;
+    unlink(temp);
+    errno = error;
+    goto fail;
   }
+  failed = NULL;
+  ret = 0;
 
-  /* Line-by-line processing */
-  char *buffer = malloc(buffer_size);
-  size_t bytes_read;
-  int last_char_was_newline = 1; /* Start with a virtual newline */
-  int consecutive_blank_lines = 0;
+fail:
+  if (failed)
+    fprintf(stderr, "%s: %s: %s\n", PACKAGE_NAME, failed, strerror(errno));
+  if (fd >= 0)
+    close(fd);
+  if (buffer)
+    buffer_free(buffer, SCAN_BLOCK_SIZE);
+  free(table);
+  free(temp);
+  free(name);
+  return ret;
+}
 
-  if (!buffer) {
-    fprintf(stderr, "%s: memory allocation failed\n", PACKAGE_NAME);
-    return 1;
+/* Open FILENAME's index and read its header into HEADER, if it was built
+   from the file as ST shows it now.  Returns the index's descriptor, or
+   -1 if there is none to go by.  */
+static int index_open(const char *filename, const struct stat *st,
+                      unsigned char *header) {
+  char *name = index_name(filename);
+  int fd = name ? open(name, O_RDONLY) : -1;
+  struct stat ist;
+
+  free(name);
+  if (fd < 0)
+    return -1;
+  if (fstat(fd, &ist) == 0 && ist.st_size >= INDEX_HEADER_SIZE &&
+      pread(fd, header, INDEX_HEADER_SIZE, 0) == INDEX_HEADER_SIZE &&
+      memcmp(header, INDEX_MAGIC, 8) == 0 && get64(header + 8) > 0 &&
+      get64(header + 16) == (unsigned long long)st->st_size &&
+      get64(header + 24) == mtime_ns(st) &&
+      (ist.st_size - INDEX_HEADER_SIZE) % INDEX_ENTRY_SIZE == 0 &&
+      get64(header + 48) ==
+          (unsigned long long)(ist.st_size - INDEX_HEADER_SIZE) /
+              INDEX_ENTRY_SIZE)
+    return fd;
+  close(fd);
+  return -1;
+}
+
+/* Move MARK on to the last line start the index at INDEX, with HEADER,
+   has at or before newline LIMIT, if that is further on */
+static void index_seek(int index, const unsigned char *header,
+                       unsigned long long limit, struct line_mark *mark) {
+  unsigned long long interval = get64(header + 8);
+  unsigned long long sample = limit / interval;
+  unsigned char entry[INDEX_ENTRY_SIZE];
+
+  if (sample > get64(header + 48))
+    sample = get64(header + 48);
+  if (sample == 0 || sample * interval <= mark->count.lines ||
+      pread(index, entry, sizeof entry,
+            (off_t)(INDEX_HEADER_SIZE + (sample - 1) * INDEX_ENTRY_SIZE)) !=
+          sizeof entry)
+    return;
+  mark->offset = get64(entry);
+  mark->count.lines = sample * interval;
+  mark->count.empty = get64(entry + 8);
+  mark->count.at_line_start = 1;
+}
+
+/* Count lines from MARK on, reading FD up to byte END, until newline
+   LIMIT; MARK ends up just after it, or at END.  BUFFER holds
+   SCAN_BLOCK_SIZE bytes.  Returns 0, or -1 on a read error.  */
+static int count_range(int fd, char *buffer, struct line_mark *mark,
+                       unsigned long long end, unsigned long long limit) {
+  while (mark->offset < end && mark->count.lines < limit) {
+    size_t want = end - mark->offset < SCAN_BLOCK_SIZE
+                      ? (size_t)(end - mark->offset)
+                      : SCAN_BLOCK_SIZE;
+    ssize_t n = pread(fd, buffer, want, (off_t)mark->offset);
+
+    if (n < 0 && errno == EINTR)
+      continue;
+    if (n < 0)
+      return -1;
+    if (n == 0)
+      break; /* The file got shorter */
+    mark->offset += dcat_count_lines(&mark->count, buffer, n, limit);
+  }
+  return 0;
+}
+
+/* One stretch of a file, counted on a thread of its own */
+struct scan_job {
+  int fd;
+  char *buffer; /* SCAN_BLOCK_SIZE bytes, kept from one scan to the next */
+  struct line_mark mark; /* where it starts, then where counting stopped */
+  unsigned long long end;
+  int look_back; /* find out if MARK starts a line from the byte before */
+  int error;     /* errno of a failed read */
+};
+static struct scan_job scan_jobs[MAX_THREADS];
+
+static void scan_job_run(void *arg) {
+  struct scan_job *job = arg;
+  char c;
+
+  /* A newline right at the start ends an empty line if one came just
+     before it */
+  if (job->look_back)
+    job->mark.count.at_line_start =
+        pread(job->fd, &c, 1, (off_t)job->mark.offset - 1) == 1 && c == '\n';
+  job->error = count_range(job->fd, job->buffer, &job->mark, job->end,
+                           ULLONG_MAX) != 0
+                   ? errno
+                   : 0;
+}
+
+/* Move MARK on to just after newline LIMIT of FD, or to its end at SIZE.
+   With worker threads, each counts the next SCAN_CHUNK_SIZE bytes in
+   turn; summing their counts in order shows which chunk holds the
+   newline, and that one is counted again up to it.  Returns 0, or -1 on
+   a read error.  */
+static int seek_newline(int fd, unsigned long long size,
+                        struct line_mark *mark, unsigned long long limit) {
+  int slices = pool.workers + 1;
+
+  for (int i = 0; i < slices; i++) {
+    if (!scan_jobs[i].buffer &&
+        !(scan_jobs[i].buffer = buffer_alloc(SCAN_BLOCK_SIZE))) {
+      slices = i;
+      break;
+    }
   }
+  if (slices == 0) {
+    errno = ENOMEM;
+    return -1;
+  }
+  if (slices == 1)
+    return count_range(fd, scan_jobs[0].buffer, mark, size, limit);
+
+  while (mark->offset < size && mark->count.lines < limit) {
+    unsigned long long at = mark->offset;
+    int count = 0;
+
+    for (; count < slices && at < size; count++) {
+      struct scan_job *job = &scan_jobs[count];
+
+      job->fd = fd;
+      job->mark.offset = at;
+      job->mark.count.lines = 0;
+      job->mark.count.empty = 0;
+      job->mark.count.at_line_start = mark->count.at_line_start;
+      job->look_back = count > 0;
+      at = size - at < SCAN_CHUNK_SIZE ? size : at + SCAN_CHUNK_SIZE;
+      job->end = at;
+    }
+    pool_run(scan_job_run, scan_jobs, sizeof scan_jobs[0], count);
+
+    for (int i = 0; i < count; i++) {
+      const struct scan_job *job = &scan_jobs[i];
 
-  while ((bytes_read = fread(buffer, 1, buffer_size, fp)) > 0) {
-    process_buffer(buffer, bytes_read, line_num, &last_char_was_newline,
-                   &consecutive_blank_lines);
+      if (job->error) {
+        errno = job->error;
+        return -1;
+      }
+      if (mark->count.lines + job->mark.count.lines >= limit)
+        return count_range(fd, scan_jobs[0].buffer, mark, job->end, limit);
+      mark->offset = job->mark.offset;
+      mark->count.lines += job->mark.count.lines;
+      mark->count.empty += job->mark.count.empty;
+      mark->count.at_line_start = job->mark.count.at_line_start;
+      if (job->mark.offset < job->end)
+        return 0; /* The file got shorter */
+    }
   }
+  return 0;
+}
 
-  free(buffer);
-  if (ferror(fp)) {
+/* --lines: point range_offset and range_length at lines lines_first to
+   lines_last of FD, found from FILENAME's index if it has an up-to-date
+   one and by counting otherwise, and number them from there for -n or -b.
+   Returns 0, or 1 after reporting an error.  */
+static int seek_lines(int fd, const char *filename, struct dcat_ctx *ctx) {
+  unsigned char header[INDEX_HEADER_SIZE];
+  struct line_mark mark = {0, {0, 0, 1}};
+  unsigned long long start;
+  struct stat st;
+  off_t base = lseek(fd, 0, SEEK_CUR); /* where standard input is at */
+  int index = -1;
+  int ret = 0;
+
+  if (fstat(fd, &st) != 0 || base < 0)
+    ret = 1;
+  else if (!S_ISREG(st.st_mode)) {
+    errno = S_ISDIR(st.st_mode) ? EISDIR : ESPIPE;
+    ret = 1;
+  }
+  if (ret) {
     fprintf(stderr, "%s: %s: %s\n", PACKAGE_NAME, filename, strerror(errno));
     return 1;
   }
 
-  return 0;
+  mark.offset = base;
+  if (strcmp(filename, "-") != 0)
+    index = index_open(filename, &st, header);
+  if (index >= 0)
+    index_seek(index, header, lines_first - 1, &mark);
+  ret = seek_newline(fd, st.st_size, &mark, lines_first - 1) != 0;
+  start = mark.offset;
+  dcat_finish(ctx);
+  dcat_reset(ctx, number_nonblank ? mark.count.lines - mark.count.empty
+                                  : mark.count.lines);
+
+  if (!ret && lines_last != ULLONG_MAX) {
+    if (index >= 0)
+      index_seek(index, header, lines_last, &mark);
+    ret = seek_newline(fd, st.st_size, &mark, lines_last) != 0;
+  }
+  if (ret)
+    fprintf(stderr, "%s: %s: %s\n", PACKAGE_NAME, filename, strerror(errno));
+  if (index >= 0)
+    close(index);
+
+  range_offset = start - base;
+  range_length = lines_last == ULLONG_MAX ? ULLONG_MAX : mark.offset - start;
+  return ret;
 }
 
 int main(int argc, char *argv[]) {
   int opt;
   int ret = 0;
-  unsigned long line_num = 0;
+  struct dcat_options opts = {0};
+  struct dcat_ctx ctx;
+  unsigned long long started = 0;
 
   /* Parse options */
-  while ((opt = getopt_long(argc, argv, "AbEnstv", long_options, NULL)) != -1) {
+  while ((opt = getopt_long(argc, argv, "AbeEnstTv", long_options, NULL)) !=
+         -1) {
     switch (opt) {
     case 'A':
       show_all = 1;
@@ -337,6 +4028,10 @@ int main(int argc, char *argv[]) {
       number_nonblank = 1;
       number_lines = 0; /* -b overrides -n */
       break;
+    case 'e':
+      show_nonprinting = 1;
+      show_ends = 1;
+      break;
     case 'E':
       show_ends = 1;
       break;
@@ -352,6 +4047,9 @@ int main(int argc, char *argv[]) {
       show_nonprinting = 1;
       show_tabs = 1;
       break;
+    case 'T':
+      show_tabs = 1;
+      break;
     case 'v':
       show_nonprinting = 1;
       break;
@@ -369,11 +4067,108 @@ int main(int argc, char *argv[]) {
     case 258: /* --hex-dump */
       hex_dump_mode = 1;
       break;
+    case 259: /* --threads */
+      thread_count = atoi(optarg);
+      if (thread_count < 1 || thread_count > MAX_THREADS) {
+        fprintf(stderr, "%s: number of threads must be between 1 and %d\n",
+                PACKAGE_NAME, MAX_THREADS);
+        exit(1);
+      }
+      break;
+    case 260: /* --pipeline */
+      pipeline_depth = optarg ? atoi(optarg) : DEFAULT_PIPELINE;
+      if (pipeline_depth < 2 || pipeline_depth > MAX_PIPELINE) {
+        fprintf(stderr, "%s: pipeline depth must be between 2 and %d\n",
+                PACKAGE_NAME, MAX_PIPELINE);
+        exit(1);
+      }
+      break;
+    case 261: /* --io */
+      if (strcmp(optarg, "sync") == 0) {
+        io_backend = IO_SYNC;
+      } else if (strcmp(optarg, "uring") == 0) {
+        io_backend = IO_URING;
+      } else {
+        fprintf(stderr, "%s: invalid I/O method '%s'\n", PACKAGE_NAME,
+                optarg);
+        usage(1);
+      }
+      break;
+    case 262: /* --prefetch */
+      prefetch_count = atoi(optarg);
+      if (prefetch_count < 0 || prefetch_count > MAX_PREFETCH) {
+        fprintf(stderr, "%s: prefetch count must be between 0 and %d\n",
+                PACKAGE_NAME, MAX_PREFETCH);
+        exit(1);
+      }
+      break;
+    case 269: /* --jobs */
+      job_count = atoi(optarg);
+      if (job_count < 0 || job_count > MAX_JOBS) {
+        fprintf(stderr, "%s: job count must be between 0 and %d\n",
+                PACKAGE_NAME, MAX_JOBS);
+        exit(1);
+      }
+      break;
+    case 263: /* --stats */
+      if (!optarg) {
+        stats_mode = STATS_TEXT;
+      } else if (strcmp(optarg, "json") == 0) {
+        stats_mode = STATS_JSON;
+      } else {
+        fprintf(stderr, "%s: invalid stats format '%s'\n", PACKAGE_NAME,
+                optarg);
+        usage(1);
+      }
+      break;
+    case 264: /* --follow */
+      follow_mode = 1;
+      break;
+    case 265: /* --decompress */
+      decompress_mode = 1;
+      break;
+    case 266: /* --offset */
+      if (parse_size(optarg, &range_offset) != 0) {
+        fprintf(stderr, "%s: invalid offset '%s'\n", PACKAGE_NAME, optarg);
+        usage(1);
+      }
+      break;
+    case 267: /* --length */
+      if (parse_size(optarg, &range_length) != 0) {
+        fprintf(stderr, "%s: invalid length '%s'\n", PACKAGE_NAME, optarg);
+        usage(1);
+      }
+      break;
+    case 268: /* --no-cache */
+      no_cache = 1;
+      break;
+    case 270: /* --build-index */
+      index_interval = optarg ? atol(optarg) : DEFAULT_INDEX_INTERVAL;
+      if (index_interval < 1) {
+        fprintf(stderr, "%s: index interval must be at least 1 line\n",
+                PACKAGE_NAME);
+        exit(1);
+      }
+      break;
+    case 272: /* --flush */
+      if (parse_flush(optarg) != 0) {
+        fprintf(stderr, "%s: invalid flush policy '%s'\n", PACKAGE_NAME,
+                optarg);
+        usage(1);
+      }
+      break;
+    case 271: /* --lines */
+      if (parse_lines(optarg) != 0) {
+        fprintf(stderr, "%s: invalid line range '%s'\n", PACKAGE_NAME,
+                optarg);
+        usage(1);
+      }
+      break;
     case 'h':
       usage(0);
       break;
     case 'V':
-      version();
+      version(dcat_kernels());
       break;
     default:
       usage(1);
@@ -381,44 +4176,153 @@ int main(int argc, char *argv[]) {
     }
   }
 
+  if (lines_first > 0 && (range_offset > 0 || range_length != ULLONG_MAX ||
+                          decompress_mode)) {
+    fprintf(stderr,
+            "%s: --lines cannot be combined with --offset, --length or "
+            "--decompress\n",
+            PACKAGE_NAME);
+    usage(1);
+  }
+  if (index_interval > 0) {
+    /* --build-index writes the indexes and nothing else */
+    if (optind >= argc) {
+      fprintf(stderr, "%s: --build-index needs a FILE\n", PACKAGE_NAME);
+      usage(1);
+    }
+    for (; optind < argc; optind++)
+      ret |= build_index(argv[optind]);
+    return ret;
+  }
+
+  if (stats_mode) {
+    started = stats_clock();
+#ifdef HAVE_LINUX_PERF_EVENT_H
+    perf_open();
+#endif
+    stats_file_begin();
+  }
+  opts.number_lines = number_lines;
+  opts.number_nonblank = number_nonblank;
+  opts.squeeze_blank = squeeze_blank;
+  opts.show_ends = show_ends;
+  opts.show_tabs = show_tabs;
+  opts.show_nonprinting = show_nonprinting;
+  opts.hex_dump = hex_dump_mode;
+  dcat_init(&ctx, &opts);
+  ctx.room = out_room;
+  ctx.write = out_direct;
+  if (thread_count > 1) {
+    pool_start(thread_count - 1);
+  }
+  grow_output_pipe();
+  if (no_cache)
+    cache_trail_init(&out_trail, STDOUT_FILENO);
+  if (show_progress)
+    progress_start(argv + optind, argc - optind);
+
   /* Process files */
   if (optind >= argc) {
     /* No files specified, read from stdin */
-    ret = process_file(stdin, "-", &line_num);
+    if (lines_first > 0 && seek_lines(STDIN_FILENO, "-", &ctx) != 0)
+      ret = 1;
+    else
+      ret = process_file(STDIN_FILENO, "-", &ctx);
+    if (stats_mode)
+      stats_file_end("-");
+  } else if (io_backend == IO_URING && !follow_mode && !decompress_mode &&
+             range_offset == 0 && range_length == ULLONG_MAX &&
+             lines_first == 0 &&
+             (ret = uring_files(argv + optind, argc - optind, &ctx)) >= 0) {
+    /* Every file went through io_uring */
   } else {
+    int ahead = optind; /* next file for --prefetch to open */
+
+    /* Without threads, open the files ahead on this one instead */
+    if (job_count > 0 && jobs_start(argv, optind, argc) != 0) {
+      if (prefetch_count < job_count)
+        prefetch_count = job_count;
+      job_count = 0;
+    }
+    if (job_count > 0)
+      prefetch_count = 0;
+
+    ret = 0;
     /* Process each file */
     for (; optind < argc; optind++) {
       const char *filename = argv[optind];
-      FILE *fp;
+      struct prefetched_file *p = &prefetched[optind % (MAX_PREFETCH + 1)];
+      int fd;
+
+      /* Open the files coming up while this one is output */
+      for (; prefetch_count > 0 && ahead < argc &&
+             ahead <= optind + prefetch_count;
+           ahead++) {
+        prefetch_file(argv[ahead], &prefetched[ahead % (MAX_PREFETCH + 1)]);
+      }
+
+      if (job_count > 0)
+        p = jobs_take(optind);
 
       if (strcmp(filename, "-") == 0) {
-        fp = stdin;
+        fd = STDIN_FILENO;
         filename = "-";
       } else {
-        fp = fopen(filename, "r");
-        if (!fp) {
+        if ((prefetch_count > 0 || job_count > 0) &&
+            (p->fd >= 0 || p->error != 0)) {
+          /* Report a failed early open here, in its place */
+          fd = p->fd;
+          errno = p->error;
+        } else {
+          fd = open(filename, O_RDONLY);
+        }
+        if (fd < 0) {
+          int error = errno;
+
+          /* Keep errors in place among the output */
+          out_flush(&ctx);
+          out_drain();
           fprintf(stderr, "%s: %s: %s\n", PACKAGE_NAME, filename,
-                  strerror(errno));
+                  strerror(error));
           ret = 1;
           continue;
         }
       }
 
-      if (process_file(fp, filename, &line_num)) {
+      if (stats_mode)
+        stats_file_begin();
+      if (lines_first > 0 && seek_lines(fd, filename, &ctx) != 0) {
+        ret = 1;
+      } else if (process_file(fd, filename, &ctx)) {
         ret = 1;
+      } else if (follow_mode && optind == argc - 1 && fd != STDIN_FILENO &&
+                 range_length == ULLONG_MAX) {
+        /* Only returns on error; interrupt dcat to stop */
+        ret |= follow_file(&fd, filename, &ctx);
       }
 
-      if (fp != stdin) {
-        fclose(fp);
+      if (fd != STDIN_FILENO) {
+        close(fd);
       }
+      if (stats_mode)
+        stats_file_end(filename);
     }
+    if (job_count > 0)
+      jobs_stop();
   }
 
   /* Ensure output is flushed */
+  dcat_finish(&ctx);
+  out_flush(&ctx);
+  out_drain();
   if (fflush(stdout) != 0) {
     fprintf(stderr, "%s: %s\n", PACKAGE_NAME, strerror(errno));
     ret = 1;
   }
+  cache_trail_end(&out_trail, STDOUT_FILENO);
+  progress_finish();
+  if (stats_mode)
+    print_stats(stats_clock() - started);
 
   return ret;
 }
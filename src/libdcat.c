@@ -0,0 +1,950 @@
+/*  libdcat - dcat's formatting engine, for use in other programs.
+    Copyright (C) 2025  Juan Manuel Rodriguez.
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>. */
+
+#include <config.h>
+#ifdef HAVE_PTHREAD
+#include <pthread.h>
+#endif
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#elif defined(__ARM_NEON) && defined(__aarch64__)
+#include <arm_neon.h>
+#endif
+#include "libdcat.h"
+
+/* Return space for at least N more bytes (N must be well below the buffer
+   size); the caller advances out_len by however much it uses */
+static inline char *out_reserve(struct dcat_ctx *ctx, size_t n) {
+  if (ctx->out_size - ctx->out_len < n)
+    ctx->room(ctx, n);
+  return ctx->out + ctx->out_len;
+}
+
+/* Append N bytes of DATA, handing huge runs to ctx->write if it is set */
+static inline void out_write(struct dcat_ctx *ctx, const char *data,
+                             size_t n) {
+  if (ctx->out_size - ctx->out_len < n) {
+    if (ctx->write && n >= ctx->out_size) {
+      ctx->write(ctx, data, n);
+      return;
+    }
+    ctx->room(ctx, n);
+  }
+  memcpy(ctx->out + ctx->out_len, data, n);
+  ctx->out_len += n;
+}
+
+void dcat_write(struct dcat_ctx *ctx, const char *data, size_t n) {
+  out_write(ctx, data, n);
+}
+
+/* Fill the escape and stop tables from the options: how -v and -T render
+   each byte, following GNU cat's notation, and which bytes the formatter
+   has to stop at.  The SIMD scanners test the same set with compares,
+   selected by the scan_controls and scan_tabs all-ones/zero masks.  */
+static void build_escape_table(struct dcat_ctx *ctx) {
+  const int show_tabs = ctx->opts.show_tabs;
+  const int show_nonprinting = ctx->opts.show_nonprinting;
+
+  for (int c = 0; c < 256; c++) {
+    char *text = ctx->escapes[c].text;
+    int n = 0;
+
+    if (c == '\t') {
+      if (show_tabs) {
+        text[n++] = '^';
+        text[n++] = 'I';
+      }
+    } else if (show_nonprinting && c != '\n' && (c < 32 || c > 126)) {
+      int low = c & 127;
+
+      if (c > 127) {
+        text[n++] = 'M';
+        text[n++] = '-';
+      }
+      if (low < 32) {
+        text[n++] = '^';
+        text[n++] = low + 64;
+      } else if (low == 127) {
+        text[n++] = '^';
+        text[n++] = '?';
+      } else {
+        text[n++] = low;
+      }
+    }
+    ctx->escapes[c].len = n;
+    ctx->stops[c] = n > 0 || c == '\n';
+  }
+
+  ctx->scan_controls = show_nonprinting ? 0xff : 0;
+  ctx->scan_tabs = show_tabs ? 0xff : 0;
+  /* -E without -v, where a CR right before LF still has to become ^M */
+  ctx->cr_ends = ctx->opts.show_ends && !show_nonprinting;
+}
+
+/* The x86 scan kernels.  With target attributes and
+   __builtin_cpu_supports() every one is built whatever the compiler
+   flags, and select_kernels() picks the best the CPU has at startup;
+   without them only those the flags allow are built.  NEON is part of
+   the AArch64 baseline and needs no check.  */
+#if defined(__x86_64__) || defined(__i386__)
+#if defined(HAVE_FUNC_ATTRIBUTE_TARGET) && defined(HAVE_BUILTIN_CPU_SUPPORTS)
+#define TARGET(isa) __attribute__((target(isa)))
+#define cpu_supports(isa) __builtin_cpu_supports(isa)
+#define KERNEL_AVX512 1
+#define KERNEL_AVX2 1
+#define KERNEL_SSE2 1
+#else
+#define TARGET(isa)
+#define cpu_supports(isa) 1
+#if defined(__AVX512BW__)
+#define KERNEL_AVX512 1
+#endif
+#if defined(__AVX2__)
+#define KERNEL_AVX2 1
+#endif
+#if defined(__SSE2__)
+#define KERNEL_SSE2 1
+#endif
+#endif
+#endif
+
+/* Scalar scan, also used for the tail the vector kernels leave */
+static const char *find_stop_scalar(const struct dcat_ctx *ctx,
+                                    const char *ptr, const char *end) {
+  while (ptr < end && !ctx->stops[(unsigned char)*ptr])
+    ptr++;
+  return ptr;
+}
+
+#if defined(KERNEL_SSE2)
+/* Bitmask of the bytes in V that are in the stop set */
+TARGET("sse2")
+static inline unsigned int stop_mask16(const struct dcat_ctx *ctx,
+                                       __m128i v) {
+  __m128i tab = _mm_cmpeq_epi8(v, _mm_set1_epi8('\t'));
+  __m128i ctrl = _mm_or_si128(_mm_cmplt_epi8(v, _mm_set1_epi8(' ')),
+                              _mm_cmpeq_epi8(v, _mm_set1_epi8(127)));
+  __m128i m = _mm_and_si128(ctrl, _mm_set1_epi8(ctx->scan_controls));
+
+  m = _mm_andnot_si128(tab, m);
+  m = _mm_or_si128(m, _mm_and_si128(tab, _mm_set1_epi8(ctx->scan_tabs)));
+  m = _mm_or_si128(m, _mm_cmpeq_epi8(v, _mm_set1_epi8('\n')));
+  return _mm_movemask_epi8(m);
+}
+
+TARGET("sse2")
+static const char *find_stop_sse2(const struct dcat_ctx *ctx,
+                                  const char *ptr, const char *end) {
+  while (end - ptr >= 16) {
+    unsigned int bits =
+        stop_mask16(ctx, _mm_loadu_si128((const __m128i *)ptr));
+    if (bits)
+      return ptr + __builtin_ctz(bits);
+    ptr += 16;
+  }
+  return find_stop_scalar(ctx, ptr, end);
+}
+#endif
+
+#if defined(KERNEL_AVX2)
+/* Bitmask of the bytes in V that are in the stop set */
+TARGET("avx2")
+static inline unsigned int stop_mask32(const struct dcat_ctx *ctx,
+                                       __m256i v) {
+  __m256i tab = _mm256_cmpeq_epi8(v, _mm256_set1_epi8('\t'));
+  __m256i ctrl =
+      _mm256_or_si256(_mm256_cmpgt_epi8(_mm256_set1_epi8(' '), v),
+                      _mm256_cmpeq_epi8(v, _mm256_set1_epi8(127)));
+  __m256i m = _mm256_and_si256(ctrl, _mm256_set1_epi8(ctx->scan_controls));
+
+  m = _mm256_andnot_si256(tab, m);
+  m = _mm256_or_si256(m,
+                      _mm256_and_si256(tab, _mm256_set1_epi8(ctx->scan_tabs)));
+  m = _mm256_or_si256(m, _mm256_cmpeq_epi8(v, _mm256_set1_epi8('\n')));
+  return _mm256_movemask_epi8(m);
+}
+
+TARGET("avx2")
+static const char *find_stop_avx2(const struct dcat_ctx *ctx,
+                                  const char *ptr, const char *end) {
+  while (end - ptr >= 32) {
+    unsigned int bits =
+        stop_mask32(ctx, _mm256_loadu_si256((const __m256i *)ptr));
+    if (bits)
+      return ptr + __builtin_ctz(bits);
+    ptr += 32;
+  }
+  return find_stop_sse2(ctx, ptr, end);
+}
+#endif
+
+#if defined(KERNEL_AVX512)
+/* Bitmask of the bytes in V that are in the stop set */
+TARGET("avx512bw")
+static inline __mmask64 stop_mask64(const struct dcat_ctx *ctx, __m512i v) {
+  __mmask64 tab = _mm512_cmpeq_epi8_mask(v, _mm512_set1_epi8('\t'));
+  __mmask64 ctrl = _mm512_cmplt_epu8_mask(v, _mm512_set1_epi8(' ')) |
+                   _mm512_cmpge_epu8_mask(v, _mm512_set1_epi8(127));
+
+  return (ctrl & ~tab & -(__mmask64)!!ctx->scan_controls) |
+         (tab & -(__mmask64)!!ctx->scan_tabs) |
+         _mm512_cmpeq_epi8_mask(v, _mm512_set1_epi8('\n'));
+}
+
+/* The tail is read with a masked load, which cannot fault past END */
+TARGET("avx512bw")
+static const char *find_stop_avx512(const struct dcat_ctx *ctx,
+                                    const char *ptr, const char *end) {
+  __mmask64 bits;
+
+  while (end - ptr >= 64) {
+    bits = stop_mask64(ctx, _mm512_loadu_si512(ptr));
+    if (bits)
+      return ptr + __builtin_ctzll(bits);
+    ptr += 64;
+  }
+  if (ptr == end)
+    return end;
+  bits = (1ULL << (end - ptr)) - 1;
+  bits &= stop_mask64(ctx, _mm512_maskz_loadu_epi8(bits, ptr));
+  return bits ? ptr + __builtin_ctzll(bits) : end;
+}
+#endif
+
+#if defined(__ARM_NEON) && defined(__aarch64__)
+/* 0xff in every lane of V that holds a byte in the stop set */
+static inline uint8x16_t stop_lanes16(const struct dcat_ctx *ctx,
+                                      uint8x16_t v) {
+  uint8x16_t tab = vceqq_u8(v, vdupq_n_u8('\t'));
+  uint8x16_t ctrl =
+      vorrq_u8(vcltq_u8(v, vdupq_n_u8(' ')), vcgeq_u8(v, vdupq_n_u8(127)));
+  uint8x16_t m = vandq_u8(ctrl, vdupq_n_u8(ctx->scan_controls));
+
+  m = vbicq_u8(m, tab);
+  m = vorrq_u8(m, vandq_u8(tab, vdupq_n_u8(ctx->scan_tabs)));
+  m = vorrq_u8(m, vceqq_u8(v, vdupq_n_u8('\n')));
+  return m;
+}
+
+static const char *find_stop_neon(const struct dcat_ctx *ctx,
+                                  const char *ptr, const char *end) {
+  while (end - ptr >= 16) {
+    uint8x16_t m = stop_lanes16(ctx, vld1q_u8((const uint8_t *)ptr));
+    if (vmaxvq_u8(m)) {
+      /* Narrow each lane to a nibble to get a 64-bit lane mask */
+      uint64_t bits = vget_lane_u64(
+          vreinterpret_u64_u8(vshrn_n_u16(vreinterpretq_u16_u8(m), 4)), 0);
+      return ptr + (__builtin_ctzll(bits) >> 2);
+    }
+    ptr += 16;
+  }
+  return find_stop_scalar(ctx, ptr, end);
+}
+#endif
+
+/* Line counting.  Each vector kernel gets a bitmask of the newlines in
+   a 64-byte block: its popcount is the lines ended there, and a newline
+   right after another (or at a line start) ends an empty one.  The block
+   holding newline LIMIT is left to the scalar count, which stops right
+   after it.  */
+static size_t count_lines_scalar(struct dcat_lines *c, const char *data,
+                                 size_t len, unsigned long long limit) {
+  const char *ptr = data;
+  const char *end = data + len;
+
+  while (ptr < end && c->lines < limit) {
+    const char *nl = memchr(ptr, '\n', end - ptr);
+
+    if (!nl) {
+      c->at_line_start = 0;
+      return len;
+    }
+    c->empty += nl == ptr && c->at_line_start;
+    c->lines++;
+    c->at_line_start = 1;
+    ptr = nl + 1;
+  }
+  return ptr - data;
+}
+
+#define COUNT_LINES_DEFINE(name, target, newlines64)                          \
+  target static size_t count_lines_##name(struct dcat_lines *c,              \
+                                          const char *data, size_t len,      \
+                                          unsigned long long limit) {        \
+    const char *ptr = data;                                                  \
+    const char *end = data + len;                                            \
+    uint64_t prev = c->at_line_start != 0;                                   \
+                                                                             \
+    while (end - ptr >= 64) {                                                \
+      uint64_t m = newlines64(ptr);                                          \
+      int n = __builtin_popcountll(m);                                       \
+                                                                             \
+      if (c->lines + n >= limit)                                             \
+        break;                                                               \
+      c->lines += n;                                                         \
+      c->empty += __builtin_popcountll(m & (m << 1 | prev));                 \
+      prev = m >> 63;                                                        \
+      ptr += 64;                                                             \
+    }                                                                        \
+    c->at_line_start = (int)prev;                                            \
+    return (ptr - data) + count_lines_scalar(c, ptr, end - ptr, limit);      \
+  }
+
+#if defined(KERNEL_SSE2)
+TARGET("sse2")
+static inline uint64_t newlines64_sse2(const char *ptr) {
+  const __m128i nl = _mm_set1_epi8('\n');
+  uint64_t m = 0;
+
+  for (int i = 0; i < 4; i++) {
+    __m128i v = _mm_loadu_si128((const __m128i *)ptr + i);
+    m |= (uint64_t)_mm_movemask_epi8(_mm_cmpeq_epi8(v, nl)) << (16 * i);
+  }
+  return m;
+}
+COUNT_LINES_DEFINE(sse2, TARGET("sse2"), newlines64_sse2)
+#endif
+
+#if defined(KERNEL_AVX2)
+TARGET("avx2")
+static inline uint64_t newlines64_avx2(const char *ptr) {
+  const __m256i nl = _mm256_set1_epi8('\n');
+  __m256i lo = _mm256_loadu_si256((const __m256i *)ptr);
+  __m256i hi = _mm256_loadu_si256((const __m256i *)ptr + 1);
+
+  return (uint32_t)_mm256_movemask_epi8(_mm256_cmpeq_epi8(lo, nl)) |
+         (uint64_t)(uint32_t)_mm256_movemask_epi8(_mm256_cmpeq_epi8(hi, nl))
+             << 32;
+}
+COUNT_LINES_DEFINE(avx2, TARGET("avx2"), newlines64_avx2)
+#endif
+
+#if defined(KERNEL_AVX512)
+TARGET("avx512bw")
+static inline uint64_t newlines64_avx512(const char *ptr) {
+  return _mm512_cmpeq_epi8_mask(_mm512_loadu_si512(ptr),
+                                _mm512_set1_epi8('\n'));
+}
+COUNT_LINES_DEFINE(avx512, TARGET("avx512bw"), newlines64_avx512)
+#endif
+
+#if defined(__ARM_NEON) && defined(__aarch64__)
+/* Each lane's bit, so that adding up each half of a compare gives its
+   byte of the mask */
+static inline uint64_t newlines64_neon(const char *ptr) {
+  static const uint8_t bits[16] = {1, 2, 4, 8, 16, 32, 64, 128,
+                                   1, 2, 4, 8, 16, 32, 64, 128};
+  const uint8x16_t weights = vld1q_u8(bits);
+  uint64_t m = 0;
+
+  for (int i = 0; i < 4; i++) {
+    uint8x16_t v = vld1q_u8((const uint8_t *)ptr + 16 * i);
+
+    v = vandq_u8(vceqq_u8(v, vdupq_n_u8('\n')), weights);
+    m |= (uint64_t)vaddv_u8(vget_low_u8(v)) << (16 * i);
+    m |= (uint64_t)vaddv_u8(vget_high_u8(v)) << (16 * i + 8);
+  }
+  return m;
+}
+COUNT_LINES_DEFINE(neon, , newlines64_neon)
+#endif
+
+/* Return the first byte in [PTR, END) in CTX's stop set, or END.  Only
+   for -v and -T: without them the stop set is just the newline.  Set by
+   select_kernels().  */
+static const char *(*find_stop)(const struct dcat_ctx *ctx, const char *ptr,
+                                const char *end) = find_stop_scalar;
+
+/* Count lines as dcat_count_lines() does; set by select_kernels() */
+static size_t (*count_lines)(struct dcat_lines *c, const char *data,
+                             size_t len,
+                             unsigned long long limit) = count_lines_scalar;
+
+/* The name of the kernel set in use */
+static const char *kernel_name = "scalar";
+
+/* Pick the widest scan kernel the CPU supports */
+static void select_kernels(void) {
+#if defined(KERNEL_AVX512)
+  if (cpu_supports("avx512bw")) {
+    find_stop = find_stop_avx512;
+    count_lines = count_lines_avx512;
+    kernel_name = "avx512bw";
+    return;
+  }
+#endif
+#if defined(KERNEL_AVX2)
+  if (cpu_supports("avx2")) {
+    find_stop = find_stop_avx2;
+    count_lines = count_lines_avx2;
+    kernel_name = "avx2";
+    return;
+  }
+#endif
+#if defined(KERNEL_SSE2)
+  if (cpu_supports("sse2")) {
+    find_stop = find_stop_sse2;
+    count_lines = count_lines_sse2;
+    kernel_name = "sse2";
+    return;
+  }
+#endif
+#if defined(__ARM_NEON) && defined(__aarch64__)
+  find_stop = find_stop_neon;
+  count_lines = count_lines_neon;
+  kernel_name = "neon";
+#endif
+}
+
+/* Two lowercase hex digits for each byte, and its ASCII column glyph */
+static const char hex_digits[] = "0123456789abcdef";
+static char hex_pairs[256][2];
+static char hex_glyphs[256];
+
+/* Fill hex_pairs and hex_glyphs */
+static void build_hex_table(void) {
+  for (int c = 0; c < 256; c++) {
+    hex_pairs[c][0] = hex_digits[c >> 4];
+    hex_pairs[c][1] = hex_digits[c & 15];
+    hex_glyphs[c] = (c >= 32 && c < 127) ? c : '.';
+  }
+}
+
+/* What every context shares: the kernels and the hex tables */
+static void setup(void) {
+  select_kernels();
+  build_hex_table();
+}
+
+/* Run setup() once, whichever thread gets here first.  dcat_hex_row()
+   comes here for every row, hence the test before pthread_once().  */
+static void setup_once(void) {
+#ifdef HAVE_PTHREAD
+  static pthread_once_t once = PTHREAD_ONCE_INIT;
+  static int done;
+
+  if (__atomic_load_n(&done, __ATOMIC_ACQUIRE))
+    return;
+  pthread_once(&once, setup);
+  __atomic_store_n(&done, 1, __ATOMIC_RELEASE);
+#else
+  static int done;
+  if (!done) {
+    setup();
+    done = 1;
+  }
+#endif
+}
+
+const char *dcat_kernels(void) {
+  setup_once();
+  return kernel_name;
+}
+
+size_t dcat_count_lines(struct dcat_lines *lines, const void *data,
+                        size_t len, unsigned long long limit) {
+  setup_once();
+  return count_lines(lines, data, len, limit);
+}
+
+void dcat_reset(struct dcat_ctx *ctx, unsigned long n) {
+  struct dcat_state *state = &ctx->state;
+  char digits[DCAT_NUMBER_SIZE];
+  int len = snprintf(digits, sizeof digits, "%lu", n);
+
+  state->line_num = n;
+  memset(state->line_text, ' ', DCAT_NUMBER_SIZE - 1);
+  memcpy(state->line_text + DCAT_NUMBER_SIZE - 1 - len, digits, len);
+  state->line_text[DCAT_NUMBER_SIZE - 1] = '\t';
+  state->line_text_start = DCAT_NUMBER_SIZE - 1 - (len > 6 ? len : 6);
+  state->last_char_was_newline = 1; /* Start with a virtual newline */
+  state->consecutive_blank_lines = 0;
+  state->pending_cr = 0;
+  ctx->offset = 0;
+  ctx->row_len = 0;
+}
+
+/* Write the next line number followed by a tab, like "%6lu\t".  The
+   decimal text is incremented in place, so the carry usually stops at
+   the last digit and the field widens by itself past 999999.  */
+static inline void write_line_number(struct dcat_ctx *ctx) {
+  struct dcat_state *state = &ctx->state;
+  char *digit = state->line_text + DCAT_NUMBER_SIZE - 2;
+  size_t len;
+
+  state->line_num++;
+  while (*digit == '9') {
+    *digit-- = '0';
+  }
+  if (*digit == ' ') {
+    *digit = '1';
+    if (digit - state->line_text < state->line_text_start) {
+      state->line_text_start = digit - state->line_text;
+    }
+  } else {
+    ++*digit;
+  }
+
+  len = DCAT_NUMBER_SIZE - state->line_text_start;
+  memcpy(out_reserve(ctx, DCAT_NUMBER_SIZE),
+         state->line_text + state->line_text_start, len);
+  ctx->out_len += len;
+}
+
+/* Write the end of a line, with a $ in front for -E */
+static inline void write_newline(struct dcat_ctx *ctx, int ends) {
+  char *out = out_reserve(ctx, 2);
+  if (ends) {
+    *out++ = '$';
+    ctx->out_len++;
+  }
+  *out = '\n';
+  ctx->out_len++;
+}
+
+/* Formatter flags, fixed once the options are known */
+#define F_SQUEEZE 1   /* -s */
+#define F_NUMBER 2    /* -n */
+#define F_NONBLANK 4  /* -b */
+#define F_ENDS 8      /* -E */
+#define F_ESCAPES 16  /* -v or -T: bytes other than newlines to rewrite */
+
+#if defined(__GNUC__)
+#define ALWAYS_INLINE inline __attribute__((always_inline))
+#else
+#define ALWAYS_INLINE inline
+#endif
+
+/* Process a buffer line by line, applying the formatting options in
+   FLAGS.  Between line starts only the bytes in the stop set are looked at
+   one by one; everything else is found by find_stop(), or memchr() when
+   only newlines stop, and copied in bulk.  FLAGS is a constant in every
+   caller, so each variant below keeps only the tests its options need.  */
+static ALWAYS_INLINE void format_lines(struct dcat_ctx *ctx,
+                                       const char *buffer, size_t size,
+                                       const int flags) {
+  struct dcat_state *state = &ctx->state;
+  /* -E shows CR LF as ^M$, unless -v has already turned the CR into ^M */
+  const int cr_ends = (flags & F_ENDS) && (!(flags & F_ESCAPES) ||
+                                           ctx->cr_ends);
+  const char *ptr = buffer;
+  const char *end = buffer + size;
+
+  /* A CR held back at the end of the last buffer: -E shows CR LF as ^M$ */
+  if (state->pending_cr && size > 0) {
+    out_write(ctx, *ptr == '\n' ? "^M" : "\r", *ptr == '\n' ? 2 : 1);
+    state->pending_cr = 0;
+  }
+
+  while (ptr < end) {
+    /* Blank lines, squeezing and numbering are settled at line starts */
+    if (state->last_char_was_newline) {
+      if (*ptr == '\n') {
+        state->consecutive_blank_lines++;
+        ptr++;
+        if ((flags & F_SQUEEZE) && state->consecutive_blank_lines > 1) {
+          continue;
+        }
+        if (flags & F_NUMBER) {
+          write_line_number(ctx);
+        }
+        write_newline(ctx, flags & F_ENDS);
+        continue;
+      }
+
+      state->consecutive_blank_lines = 0;
+      state->last_char_was_newline = 0;
+      if (flags & (F_NUMBER | F_NONBLANK)) {
+        write_line_number(ctx);
+      }
+    }
+
+    /* Copy the run up to the next byte that needs attention; with -E a
+       CR ending the run is held back in case a newline follows it */
+    const char *stop;
+    if (flags & F_ESCAPES) {
+      stop = find_stop(ctx, ptr, end);
+    } else {
+      stop = memchr(ptr, '\n', end - ptr);
+      if (!stop)
+        stop = end;
+    }
+    size_t run = stop - ptr;
+    int cr = cr_ends && run > 0 && stop[-1] == '\r' &&
+             (stop == end || *stop == '\n');
+    out_write(ctx, ptr, run - cr);
+    if (stop == end) {
+      state->pending_cr = cr;
+      break;
+    }
+    if (cr) {
+      out_write(ctx, "^M", 2);
+    }
+
+    unsigned char c = *stop;
+    ptr = stop + 1;
+    if (c == '\n') {
+      write_newline(ctx, flags & F_ENDS);
+      state->last_char_was_newline = 1;
+    } else {
+      const char *text = ctx->escapes[c].text;
+      memcpy(out_reserve(ctx, sizeof ctx->escapes[c].text), text,
+             sizeof ctx->escapes[c].text);
+      ctx->out_len += ctx->escapes[c].len;
+    }
+  }
+}
+
+/* One formatter per combination of flags; -n and -b never come together,
+   and -s alone has squeeze_lines() instead */
+#define FORMAT_VARIANTS(X)                                                     \
+  X(0) X(2) X(3) X(4) X(5) X(8) X(9) X(10) X(11) X(12) X(13) X(16)      \
+  X(17) X(18) X(19) X(20) X(21) X(24) X(25) X(26) X(27) X(28) X(29)
+
+#define FORMAT_DEFINE(f)                                                       \
+  static void format_##f(struct dcat_ctx *ctx, const char *buffer,            \
+                         size_t size) {                                        \
+    format_lines(ctx, buffer, size, f);                                        \
+  }
+#define FORMAT_ENTRY(f) [f] = format_##f,
+
+FORMAT_VARIANTS(FORMAT_DEFINE)
+
+/* Return the end of the blank-run prefix of [PTR, END): the first byte
+   that is not a newline, or END */
+static const char *skip_newlines(const char *ptr, const char *end) {
+  const size_t newlines = (size_t)-1 / 255 * '\n';
+  size_t word;
+
+  while ((size_t)(end - ptr) >= sizeof word) {
+    memcpy(&word, ptr, sizeof word);
+    if (word != newlines)
+      break;
+    ptr += sizeof word;
+  }
+  while (ptr < end && *ptr == '\n')
+    ptr++;
+  return ptr;
+}
+
+/* Return the first of two newlines in a row in [PTR, END), or NULL */
+static const char *find_blank(const char *ptr, const char *end) {
+  while ((ptr = memchr(ptr, '\n', end - ptr)) && ++ptr < end) {
+    if (*ptr == '\n')
+      return ptr - 1;
+  }
+  return NULL;
+}
+
+/* -s on its own: the only change is dropping every newline that follows
+   two others, so text is copied in bulk up to the next "\n\n" and the
+   rest of that blank run is skipped a word at a time.  The virtual
+   newline at the start of input counts as one of the two.  */
+static void squeeze_lines(struct dcat_ctx *ctx, const char *buffer,
+                          size_t size) {
+  struct dcat_state *state = &ctx->state;
+  const char *ptr = buffer;
+  const char *end = buffer + size;
+
+  while (ptr < end) {
+    if (state->last_char_was_newline) {
+      if (state->consecutive_blank_lines > 0) {
+        const char *text = skip_newlines(ptr, end);
+
+        state->consecutive_blank_lines += text - ptr;
+        ptr = text;
+        if (ptr == end)
+          break;
+      } else if (*ptr == '\n') {
+        state->consecutive_blank_lines = 1;
+        write_newline(ctx, 0);
+        ptr++;
+        continue;
+      }
+    }
+
+    const char *blank = find_blank(ptr, end);
+    if (!blank) {
+      out_write(ctx, ptr, end - ptr);
+      state->last_char_was_newline = end[-1] == '\n';
+      state->consecutive_blank_lines = 0;
+      break;
+    }
+    out_write(ctx, ptr, blank + 2 - ptr);
+    state->last_char_was_newline = 1;
+    state->consecutive_blank_lines = 1;
+    ptr = blank + 2;
+  }
+}
+
+static void (*const formatters[32])(struct dcat_ctx *, const char *,
+                                    size_t) = {
+    FORMAT_VARIANTS(FORMAT_ENTRY)[F_SQUEEZE] = squeeze_lines};
+
+void dcat_format(struct dcat_ctx *ctx, const char *data, size_t len) {
+  ctx->format(ctx, data, len);
+}
+
+void dcat_finish(struct dcat_ctx *ctx) {
+  if (ctx->state.pending_cr) {
+    out_write(ctx, "\r", 1);
+    ctx->state.pending_cr = 0;
+  }
+}
+
+/* The offset takes at least 8 digits and grows past them, so offsets
+   beyond 4GB print in full even where unsigned long is 32 bits */
+static inline size_t hex_row(char *out, const unsigned char *row,
+                             size_t length, unsigned long long offset) {
+  char *p = out;
+  int digits = 8;
+
+  while (digits < 16 && (offset >> (4 * digits)) != 0)
+    digits++;
+  for (int i = digits - 1; i >= 0; i--)
+    *p++ = hex_digits[(offset >> (4 * i)) & 15];
+  *p++ = ':';
+  *p++ = ' ';
+
+  for (size_t j = 0; j < 16; j++) {
+    if (j < length) {
+      memcpy(p, hex_pairs[row[j]], 2);
+    } else {
+      p[0] = p[1] = ' ';
+    }
+    p[2] = ' ';
+    p += 3;
+
+    /* Add space between 8-byte groups */
+    if (j == 7)
+      *p++ = ' ';
+  }
+
+  *p++ = ' ';
+  for (size_t j = 0; j < 16; j++)
+    *p++ = j < length ? hex_glyphs[row[j]] : ' ';
+  *p++ = '\n';
+  return p - out;
+}
+
+size_t dcat_hex_row(char *out, const unsigned char *row, size_t length,
+                    unsigned long long offset) {
+  setup_once();
+  return hex_row(out, row, length, offset);
+}
+
+void dcat_hex_dump(struct dcat_ctx *ctx, const unsigned char *buffer,
+                   size_t length, unsigned long long offset) {
+  for (size_t i = 0; i < length; i += 16) {
+    size_t row = length - i < 16 ? length - i : 16;
+    ctx->out_len += hex_row(out_reserve(ctx, DCAT_HEX_ROW_MAX), buffer + i,
+                            row, offset + i);
+  }
+}
+
+int dcat_init(struct dcat_ctx *ctx, const struct dcat_options *opts) {
+  int flags = 0;
+
+  setup_once();
+  memset(ctx, 0, sizeof *ctx);
+  ctx->opts = *opts;
+  if (ctx->opts.number_nonblank)
+    ctx->opts.number_lines = 0;
+  build_escape_table(ctx);
+
+  if (ctx->opts.squeeze_blank)
+    flags |= F_SQUEEZE;
+  if (ctx->opts.number_lines)
+    flags |= F_NUMBER;
+  if (ctx->opts.number_nonblank)
+    flags |= F_NONBLANK;
+  if (ctx->opts.show_ends)
+    flags |= F_ENDS;
+  if (ctx->opts.show_nonprinting || ctx->opts.show_tabs)
+    flags |= F_ESCAPES;
+  ctx->format = formatters[flags];
+  dcat_reset(ctx, 0);
+  return 0;
+}
+
+void dcat_free(struct dcat_ctx *ctx) {
+  free(ctx->kept);
+  ctx->kept = NULL;
+  ctx->kept_pos = ctx->kept_len = ctx->kept_size = 0;
+}
+
+/* Output lost after running out of memory goes nowhere */
+static void discard(struct dcat_ctx *ctx, const char *data, size_t n) {
+  (void)ctx;
+  (void)data;
+  (void)n;
+}
+
+/* dcat_push() output that does not fit in the caller's buffer goes on to
+   the kept buffer, which grows for it */
+static void keep_room(struct dcat_ctx *ctx, size_t n) {
+  size_t size;
+  char *kept;
+
+  if (ctx->failed) {
+    ctx->out_len = 0; /* the scratch space: drop what is in it */
+    return;
+  }
+  if (!ctx->keeping) {
+    ctx->caller_len = ctx->out_len;
+    ctx->keeping = 1;
+    ctx->out = ctx->kept;
+    ctx->out_len = ctx->kept_len;
+    ctx->out_size = ctx->kept_size;
+    if (ctx->out_size - ctx->out_len >= n)
+      return;
+  }
+
+  size = ctx->out_size * 2 > ctx->out_len + n ? ctx->out_size * 2
+                                              : ctx->out_len + n;
+  kept = realloc(ctx->kept, size);
+  if (!kept) {
+    ctx->kept_len = ctx->out_len;
+    ctx->failed = 1;
+    ctx->out = ctx->scratch;
+    ctx->out_len = 0;
+    ctx->out_size = sizeof ctx->scratch;
+    ctx->write = discard;
+    return;
+  }
+  ctx->out = ctx->kept = kept;
+  ctx->out_size = ctx->kept_size = size;
+}
+
+/* Point CTX's output at SIZE bytes at OUT, unless output is still kept
+   from before: then the new output has to go after it */
+static void push_begin(struct dcat_ctx *ctx, void *out, size_t size) {
+  ctx->room = keep_room;
+  ctx->write = ctx->failed ? discard : NULL;
+  ctx->caller_len = 0;
+  if (ctx->failed) {
+    ctx->out = ctx->scratch;
+    ctx->out_len = 0;
+    ctx->out_size = sizeof ctx->scratch;
+  } else if (ctx->kept_pos < ctx->kept_len) {
+    ctx->keeping = 1;
+    ctx->out = ctx->kept;
+    ctx->out_len = ctx->kept_len;
+    ctx->out_size = ctx->kept_size;
+  } else {
+    ctx->keeping = 0;
+    ctx->kept_pos = ctx->kept_len = 0;
+    ctx->out = out;
+    ctx->out_len = 0;
+    ctx->out_size = size;
+  }
+}
+
+/* Return how much of the caller's buffer push_begin()'s output used */
+static size_t push_end(struct dcat_ctx *ctx) {
+  if (ctx->failed)
+    return ctx->caller_len;
+  if (!ctx->keeping)
+    return ctx->out_len;
+  ctx->kept_len = ctx->out_len;
+  return ctx->caller_len;
+}
+
+/* Hex dump whole rows, keeping the start of the last one in ctx->row
+   until more input fills it */
+static void hex_push(struct dcat_ctx *ctx, const unsigned char *data,
+                     size_t len) {
+  size_t whole;
+
+  if (ctx->row_len > 0) {
+    size_t n = 16 - ctx->row_len < len ? 16 - ctx->row_len : len;
+
+    memcpy(ctx->row + ctx->row_len, data, n);
+    ctx->row_len += n;
+    data += n;
+    len -= n;
+    if (ctx->row_len < 16)
+      return;
+    dcat_hex_dump(ctx, ctx->row, 16, ctx->offset);
+    ctx->offset += 16;
+    ctx->row_len = 0;
+  }
+  whole = len / 16 * 16;
+  dcat_hex_dump(ctx, data, whole, ctx->offset);
+  ctx->offset += whole;
+  memcpy(ctx->row, data + whole, len - whole);
+  ctx->row_len = len - whole;
+}
+
+size_t dcat_pull(struct dcat_ctx *ctx, void *out, size_t size) {
+  size_t n = ctx->kept_len - ctx->kept_pos;
+
+  if (n > size)
+    n = size;
+  if (n > 0)
+    memcpy(out, ctx->kept + ctx->kept_pos, n);
+  ctx->kept_pos += n;
+  if (ctx->kept_pos == ctx->kept_len)
+    ctx->kept_pos = ctx->kept_len = 0;
+  return n;
+}
+
+size_t dcat_push(struct dcat_ctx *ctx, const void *data, size_t len,
+                 void *out, size_t size) {
+  size_t used = dcat_pull(ctx, out, size);
+
+  push_begin(ctx, (char *)out + used, size - used);
+  if (ctx->opts.hex_dump)
+    hex_push(ctx, data, len);
+  else if (len > 0)
+    ctx->format(ctx, data, len);
+  return used + push_end(ctx);
+}
+
+size_t dcat_end(struct dcat_ctx *ctx, void *out, size_t size) {
+  size_t used = dcat_pull(ctx, out, size);
+
+  push_begin(ctx, (char *)out + used, size - used);
+  if (ctx->opts.hex_dump && ctx->row_len > 0) {
+    dcat_hex_dump(ctx, ctx->row, ctx->row_len, ctx->offset);
+    ctx->offset += ctx->row_len;
+    ctx->row_len = 0;
+  } else {
+    dcat_finish(ctx);
+  }
+  return used + push_end(ctx);
+}
+
+size_t dcat_bound(const struct dcat_ctx *ctx, size_t len) {
+  size_t kept = ctx->kept_len - ctx->kept_pos;
+
+  if (ctx->opts.hex_dump)
+    return kept + ((ctx->row_len + len) / 16 + 1) * DCAT_HEX_ROW_MAX;
+  /* A byte is at most an escape, or a newline with its $, plus a line
+     number; a held-back CR may still become ^M */
+  return kept + len * (sizeof ctx->escapes[0].text +
+                       (ctx->opts.number_lines || ctx->opts.number_nonblank
+                            ? DCAT_NUMBER_SIZE
+                            : 0)) +
+         2;
+}
+
+int dcat_failed(const struct dcat_ctx *ctx) { return ctx->failed; }
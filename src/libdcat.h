@@ -0,0 +1,195 @@
+/*  libdcat - dcat's formatting engine, for use in other programs.
+    Copyright (C) 2025  Juan Manuel Rodriguez.
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>. */
+
+/* Everything dcat does to the bytes it copies -- the GNU cat options
+   -n, -b, -s, -E, -T and -v, and --hex-dump -- behind a context that
+   holds the options and the numbering state, so any number of streams
+   can be formatted at once, on any threads.
+
+   The simple way in is to push input and pull output:
+
+     struct dcat_ctx ctx;
+     struct dcat_options opts = {0};
+
+     opts.show_nonprinting = 1;
+     dcat_init(&ctx, &opts);
+     n = dcat_push(&ctx, data, len, out, sizeof out);
+     ...
+     n = dcat_end(&ctx, out, sizeof out);
+     dcat_free(&ctx);
+
+   dcat_push() writes straight into the caller's buffer; output that does
+   not fit is kept in the context for dcat_pull(), and never is if the
+   buffer holds dcat_bound() bytes.  Line numbers and blank-line squeezing
+   carry on from one push to the next, as they do across files in dcat.
+
+   dcat itself drives the lower level below, where the context writes
+   into an output buffer and calls back when it is full.  */
+
+#ifndef LIBDCAT_H
+#define LIBDCAT_H
+
+#include <stddef.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* Room for the widest unsigned long line number, right-aligned, plus
+   its tab */
+#define DCAT_NUMBER_SIZE 24
+
+/* Longest hex dump row: a 16-digit offset, ": ", 16 hex pairs and their
+   spaces, the group gap, and the ASCII column with its newline */
+#define DCAT_HEX_ROW_MAX (16 + 2 + 16 * 3 + 1 + 1 + 16 + 1)
+
+/* Formatting options; nonzero turns one on */
+struct dcat_options {
+  int number_lines;     /* -n: number all output lines */
+  int number_nonblank;  /* -b: number nonempty lines, overrides -n */
+  int squeeze_blank;    /* -s: suppress repeated empty lines */
+  int show_ends;        /* -E: $ at the end of each line */
+  int show_tabs;        /* -T: TAB as ^I */
+  int show_nonprinting; /* -v: ^ and M- notation, except LFD and TAB */
+  int hex_dump;         /* --hex-dump, which overrides all the others */
+};
+
+/* Numbering and blank-line state, carried from one buffer, and one file,
+   to the next */
+struct dcat_state {
+  unsigned long line_num; /* last line number written */
+  /* line_num in decimal, padded to at least 6 columns and followed by a
+     tab, as printed from line_text + line_text_start */
+  char line_text[DCAT_NUMBER_SIZE];
+  int line_text_start;
+  int last_char_was_newline;
+  int consecutive_blank_lines;
+  int pending_cr; /* trailing CR of a partial line, not yet written */
+};
+
+struct dcat_ctx {
+  struct dcat_options opts;
+  struct dcat_state state;
+  unsigned long long offset; /* dcat_push(): hex dump offset of ROW */
+
+  /* Output goes to OUT_SIZE bytes at OUT, OUT_LEN of them used so far.
+     ROOM is called when fewer than N are free, and must free them by
+     writing the buffer out or growing it.  WRITE, if set, takes runs at
+     least as long as the whole buffer instead of them being copied in.
+     OPAQUE is the caller's.  dcat_push() sets all of these itself.  */
+  char *out;
+  size_t out_len;
+  size_t out_size;
+  void (*room)(struct dcat_ctx *ctx, size_t n);
+  void (*write)(struct dcat_ctx *ctx, const char *data, size_t n);
+  void *opaque;
+
+  /* The rest is private to libdcat */
+  void (*format)(struct dcat_ctx *ctx, const char *data, size_t len);
+  struct {
+    char text[4];
+    unsigned char len;
+  } escapes[256];           /* how -v and -T show each byte, if LEN > 0 */
+  unsigned char stops[256]; /* bytes the formatter has to stop at */
+  unsigned char scan_controls;
+  unsigned char scan_tabs;
+  int cr_ends;
+  unsigned char row[16]; /* the start of a hex row not pushed whole */
+  size_t row_len;
+  char *kept; /* output from dcat_push() that did not fit */
+  size_t kept_pos;
+  size_t kept_len;
+  size_t kept_size;
+  size_t caller_len; /* bytes of the caller's buffer used */
+  int keeping;       /* output is going to KEPT */
+  int failed;        /* out of memory; output was lost */
+  char scratch[DCAT_HEX_ROW_MAX];
+};
+
+/* Set up CTX to format with OPTS, at the start of input.  Returns 0.  */
+int dcat_init(struct dcat_ctx *ctx, const struct dcat_options *opts);
+
+/* Free what CTX holds; it can be set up again with dcat_init() */
+void dcat_free(struct dcat_ctx *ctx);
+
+/* Start CTX over at the start of input, with the line number at N */
+void dcat_reset(struct dcat_ctx *ctx, unsigned long n);
+
+/* Format LEN bytes of input at DATA into SIZE bytes at OUT.  Returns how
+   many bytes of OUT were used; what did not fit waits for dcat_pull().  */
+size_t dcat_push(struct dcat_ctx *ctx, const void *data, size_t len,
+                 void *out, size_t size);
+
+/* Copy up to SIZE bytes of the output waiting in CTX to OUT.  Returns how
+   many were copied, 0 once nothing is waiting.  */
+size_t dcat_pull(struct dcat_ctx *ctx, void *out, size_t size);
+
+/* End the input: output what CTX still holds back, the last partial hex
+   row or a CR that might have started a CR LF, into SIZE bytes at OUT.
+   Returns how many bytes were used; the rest waits for dcat_pull().  */
+size_t dcat_end(struct dcat_ctx *ctx, void *out, size_t size);
+
+/* Most output dcat_push() can make from LEN bytes, counting what is held
+   back from earlier pushes */
+size_t dcat_bound(const struct dcat_ctx *ctx, size_t len);
+
+/* Nonzero if memory ran out growing the kept output, which lost some; the
+   context has to be set up again */
+int dcat_failed(const struct dcat_ctx *ctx);
+
+/* The lower level: format LEN bytes at DATA into CTX's output buffer,
+   as text even with --hex-dump.  A CR at the very end is held back;
+   dcat_finish() writes it.  */
+void dcat_format(struct dcat_ctx *ctx, const char *data, size_t len);
+
+/* Write out a CR held back at the end of input */
+void dcat_finish(struct dcat_ctx *ctx);
+
+/* Hex dump LEN bytes at DATA, the first of them at OFFSET, into CTX's
+   output buffer.  Every row is whole but the last.  */
+void dcat_hex_dump(struct dcat_ctx *ctx, const unsigned char *data,
+                   size_t len, unsigned long long offset);
+
+/* Format one hex dump row of up to 16 bytes at OFFSET into OUT, which
+   must have room for DCAT_HEX_ROW_MAX bytes.  Returns the row length.  */
+size_t dcat_hex_row(char *out, const unsigned char *row, size_t len,
+                    unsigned long long offset);
+
+/* Copy N bytes at DATA into CTX's output buffer as they are */
+void dcat_write(struct dcat_ctx *ctx, const char *data, size_t n);
+
+/* Running line counts, for finding lines by number; start them at
+   {0, 0, 1} at the start of input */
+struct dcat_lines {
+  unsigned long long lines; /* newlines counted */
+  unsigned long long empty; /* of them, those that ended an empty line */
+  int at_line_start;        /* the last byte counted was a newline */
+};
+
+/* Count the lines in LEN bytes at DATA into LINES with the SIMD scan
+   kernels, stopping right after the newline that makes LINES->lines
+   LIMIT.  Returns how many bytes were counted.  */
+size_t dcat_count_lines(struct dcat_lines *lines, const void *data,
+                        size_t len, unsigned long long limit);
+
+/* The name of the scan kernels picked for this CPU, such as "avx2" */
+const char *dcat_kernels(void);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* LIBDCAT_H */